@@ -5,8 +5,14 @@
 #define JP_SYMEXPORT
 #endif
 
+// json_fd_sink needs write(2), only built where POSIX provides it.
+#if !defined(JP_POSIX) && (defined(__unix__) || defined(__APPLE__))
+#define JP_POSIX
+#endif
+
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdio.h>
 
 struct json_allocator {
   void *(*al_malloc)(ptrdiff_t sz, void *ctx);
@@ -50,20 +56,95 @@ struct json_source {
   unsigned char (*get_byte)(void *);
   bool (*has_next)(void *);
   void *ctx;
+  // Optional, goes back to the first byte. Needed by the exact size mode.
+  void (*rewind)(void *);
 };
 
 typedef struct json_parser Json_Parser;
 typedef struct json_ast_node Json_View;
 
+// Returns NULL when al fails.
 Json_Parser * make_parser(struct json_source src, struct json_allocator al);
 void json_parser_set_streaming(Json_Parser *p, bool streaming);
 void json_parser_set_max_depth(Json_Parser *p, int max_depth);
+// Count the elements of every container in a first pass over the source and
+// allocate each one exactly once. Needs source.rewind, ignored when streaming.
+void json_parser_set_exact_size(Json_Parser *p, bool exact);
+// Collect the children of open containers on one reusable stack and copy each
+// container into the arena at its exact size when it closes.
+void json_parser_set_scratch_build(Json_Parser *p, bool scratch);
+// Start each array and object at the average size of the ones seen under the
+// same key at the same depth in earlier documents, and return what a
+// container didn't fill.
+// The averages survive json_parser_reset. Exact size and scratch win over it.
+void json_parser_set_adaptive_size(Json_Parser *p, bool adaptive);
+// Keep only the values under paths like "/id", "/user/name" or "/items/*/price"
+// in the documents parsed from now on, everything else is skipped without
+// being built. Segments are raw key bytes, * matches any key or array element
+// and "" keeps the whole document. Copies paths, len 0 turns it off. Returns
+// false and keeps everything on a path that doesn't start with '/' or when
+// out of memory.
+bool json_parser_set_projection(Json_Parser *p, const char *const *paths, ptrdiff_t len);
+// Bytes of arena memory json_parser_reset keeps for reuse, -1 keeps everything.
+void json_parser_set_arena_high_water(Json_Parser *p, ptrdiff_t bytes);
 const Json_View * json_parse(Json_Parser *p);
-int json_parser_linenum(Json_Parser *p);
-int json_parser_position(Json_Parser *p);
+int json_parser_linenum(const Json_Parser *p);
+int json_parser_position(const Json_Parser *p);
 void json_parser_reset(Json_Parser *p);
 void destroy_parser(Json_Parser *p);
 
+enum json_stats_class {
+  JSON_STATS_LITERAL,
+  JSON_STATS_STRING,
+  JSON_STATS_NUMBER,
+  JSON_STATS_CLASS_SIZE
+};
+
+// Hot path counters since the parser was made or last reset.
+struct json_stats {
+  ptrdiff_t bytes;                                // bytes consumed from the source
+  ptrdiff_t transitions[JSON_STATS_CLASS_SIZE];   // scalar DFA steps by kind of value
+  ptrdiff_t string_appends;                       // bytes appended to string builders
+  ptrdiff_t copies;                               // allocations moved to grow them
+  ptrdiff_t bytes_copied;                         // bytes those moves copied
+  ptrdiff_t container_grows;                      // arrays and objects that outgrew their capacity
+  ptrdiff_t arena_blocks;                         // arena blocks allocated
+  ptrdiff_t arena_bytes;                          // bytes in those blocks
+  ptrdiff_t peak_depth;                           // deepest container nesting
+};
+
+// Arena memory of a parser. reserved is what the blocks hold from the
+// allocator, used what the current document still reaches, abandoned what
+// arrays, objects and strings left behind when they had to move to grow, and
+// peak the most ever reserved at once.
+struct json_memory {
+  ptrdiff_t reserved;
+  ptrdiff_t used;
+  ptrdiff_t abandoned;
+  ptrdiff_t peak;
+};
+
+struct json_memory json_parser_memory(const Json_Parser *p);
+
+// Moves the parsed document into one block of exactly its size, children
+// right after their parents, and releases every other arena block. Only what
+// the root reaches is kept, other views into the parser become invalid.
+// Returns false and leaves the document as it was when the allocator fails.
+bool json_parser_compact(Json_Parser *p);
+
+// Arena blocks released by destroy_parser and json_parser_reset wait in a
+// per thread cache of up to cap bytes for the next parser on that thread
+// using the same allocator. 0, the default, turns the cache off and frees
+// what it holds. A thread's cache is emptied when it exits, except on the main
+// thread and where C11 threads are missing, flush it there before exiting.
+void json_block_cache_set_cap(ptrdiff_t cap);
+void json_block_cache_flush(void);
+
+// Fills out and returns true when the library was built with -DJP_STATS,
+// otherwise zeroes out and returns false. The counters cost nothing when
+// compiled out.
+bool json_parser_stats(const Json_Parser *p, struct json_stats *out);
+
 Json_Type json_type(const Json_View *v);
 double json_number(const Json_View *v);
 bool json_bool(const Json_View *v);
@@ -73,4 +154,106 @@ const Json_View * json_array_at(const Json_View *v, ptrdiff_t i);
 const ustring* json_object_keys(const Json_View *v, ptrdiff_t *out_len);
 const Json_View * json_object_val(const Json_View *v, const ustring key);
 const char * json_error(const Json_View *v);
+
+// Building and editing documents. New values come from the parser's arena and
+// stay valid until it is reset or destroyed. Containers store values by copy,
+// so the node handed to json_array_push or json_object_set stays behind in the
+// arena unused. The pointer they return is the stored copy and can be edited,
+// but only until the next append to the same container, which may move it.
+Json_View * json_parser_root(Json_Parser *p);
+Json_View * json_mut(const Json_View *v);
+Json_View * json_new_null(Json_Parser *p);
+Json_View * json_new_bool(Json_Parser *p, bool b);
+Json_View * json_new_number(Json_Parser *p, double num);
+Json_View * json_new_string(Json_Parser *p, ustring s);
+Json_View * json_new_array(Json_Parser *p);
+Json_View * json_new_object(Json_Parser *p);
+Json_View * json_array_push(Json_Parser *p, Json_View *arr, const Json_View *val);
+// Replaces the value of key if it is already present, appends it otherwise.
+Json_View * json_object_set(Json_Parser *p, Json_View *obj, ustring key, const Json_View *val);
+void json_replace(Json_View *dst, const Json_View *src);
+
+// Deep copies v into a single block from al, so a small part of a document
+// can outlive its parser. The copy is read only, release it with
+// json_clone_free. Returns NULL for a NULL v and when al fails.
+const Json_View * json_clone(const Json_View *v, struct json_allocator al);
+void json_clone_free(const Json_View *v);
+
+// Decoding straight into C structs. A json_struct_desc lists the fields of a
+// struct, json_decode reads one object from the source into it. Unknown keys
+// are skipped without building anything, null leaves a field untouched.
+enum json_field_type {
+  JSON_FIELD_BOOL,    // bool
+  JSON_FIELD_INT,     // int64_t, fractions, exponents and overflow don't match
+  JSON_FIELD_DOUBLE,  // double
+  JSON_FIELD_STRING,  // ustring in the parser's arena
+  JSON_FIELD_OBJECT,  // nested struct described by desc
+  JSON_FIELD_VIEW     // const Json_View * to any value
+};
+
+struct json_struct_desc;
+
+struct json_field {
+  const char *name;
+  enum json_field_type type;
+  ptrdiff_t offset;
+  bool required;
+  const struct json_struct_desc *desc;
+};
+
+struct json_struct_desc {
+  const struct json_field *fields;
+  ptrdiff_t len;  // at most 64, json_decode fails on larger ones
+  // Optional, returns the index of the field named by key or -1.
+  ptrdiff_t (*match)(const unsigned char *key, ptrdiff_t len);
+};
+
+bool json_decode(Json_Parser *p, const struct json_struct_desc *desc, void *out);
+// Message for the error that stopped the last parse or decode, NULL if none.
+const char * json_parser_error(const Json_Parser *p);
+
+enum json_write_flags {
+  JSON_WRITE_COMPACT = 0,
+  JSON_WRITE_PRETTY = 1
+};
+
+// Writes v as JSON into buf, NUL terminated and truncated to fit in cap bytes.
+// Returns the length of the complete output like snprintf, -1 on error nodes
+// and on containers nested more than 256 deep, which need json_serialize_alloc.
+ptrdiff_t json_serialize(const Json_View *v, int flags, unsigned char *buf, ptrdiff_t cap);
+// Same but into a buffer from al that grows as needed, release it with al_free.
+ustring json_serialize_alloc(const Json_View *v, int flags, struct json_allocator al);
+
+// Destination of a Json_Writer, write returns false when it could not take
+// all the bytes.
+struct json_sink {
+  bool (*write)(const unsigned char *buf, ptrdiff_t len, void *ctx);
+  void *ctx;
+};
+
+typedef struct json_writer Json_Writer;
+
+#ifdef JP_POSIX
+struct json_sink json_fd_sink(int fd);
+#endif
+struct json_sink json_file_sink(FILE *f);
+
+// Streams JSON to sink through a 64 KiB buffer without building a tree. Every
+// call returns false once the writer failed or when it would produce malformed
+// output. Values at the top level are written one per line.
+Json_Writer * make_writer(struct json_sink sink, struct json_allocator al, int flags);
+bool json_write_begin_object(Json_Writer *w);
+bool json_write_end_object(Json_Writer *w);
+bool json_write_begin_array(Json_Writer *w);
+bool json_write_end_array(Json_Writer *w);
+bool json_write_key(Json_Writer *w, ustring key);
+bool json_write_string(Json_Writer *w, ustring s);
+bool json_write_number(Json_Writer *w, double num);
+bool json_write_int(Json_Writer *w, long long num);
+bool json_write_bool(Json_Writer *w, bool b);
+bool json_write_null(Json_Writer *w);
+bool json_write_view(Json_Writer *w, const Json_View *v);
+bool json_writer_flush(Json_Writer *w);
+// Flushes and frees w, false if anything failed or a container is still open.
+bool destroy_writer(Json_Writer *w);
 #endif
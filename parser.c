@@ -7,9 +7,38 @@
 #include <stdint.h>
 #include <stdalign.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <errno.h>
+#ifndef __STDC_NO_THREADS__
+#include <threads.h>
+#endif
 
 #include "json_parser.h"
-#define INIT_ARENA_SIZE 1024*1024
+#ifdef JP_POSIX
+#include <unistd.h>
+#endif
+
+#define ARRAY_LEN(arr) (sizeof(arr)/sizeof(*(arr)))
+#define INIT_ARENA_SIZE (1024*1024)
+#define MAX_ARENA_SIZE (64*1024*1024)
+#define ARENA_BIG_ALLOC (INIT_ARENA_SIZE/4)
+
+#define JP_FLAG_STREAMING 1
+#define JP_FLAG_EXACT_SIZE 2
+#define JP_FLAG_SCRATCH 4
+#define JP_FLAG_ADAPTIVE 8
+
+// Sizes the adaptive size mode learns, containers share one by depth, type
+// and the key they sit under.
+#define LEARN_SLOTS 256
+
+// Counters for json_parser_stats, compiled in with -DJP_STATS.
+#ifdef JP_STATS
+#define JP_STAT(expr) ((void)(expr))
+#else
+#define JP_STAT(expr) ((void)0)
+#endif
 
 enum json_err {
   JSON_ERR_OBJ_CURLY_START,
@@ -38,6 +67,10 @@ enum json_err {
   JSON_ERR_DOUBLE_EXPONENT,
   JSON_ERR_CATCH_ALL,
   JSON_ERR_OOM,
+  JSON_ERR_MAX_DEPTH,
+  JSON_ERR_TYPE_MISMATCH,
+  JSON_ERR_MISSING_FIELD,
+  JSON_ERR_TOO_MANY_FIELDS,
   JSON_ERR_ENUM_SIZE
 };
 
@@ -63,73 +96,271 @@ struct json_ast_node {
   } value;
 };
 
+// A container that is still open in parse_json_value
+struct json_frame {
+  struct json_ast_node node;
+  ustring key;     // key of the value being parsed when node is an object
+  ptrdiff_t base;  // scratch stack length when the container was opened
+  ptrdiff_t learn; // slot in learned for the adaptive size mode
+  ptrdiff_t proj;  // projection node of the container, or PROJ_ALL
+};
+
+// A projection is a trie of path segments with node 0 as the root. The
+// children of a node are linked through sibling, keep marks the end of a path
+// whose whole subtree is kept.
+struct json_proj {
+  ustring key;
+  ptrdiff_t child;
+  ptrdiff_t sibling;
+  bool keep;
+};
+
+#define PROJ_ALL -1   // keep the value and everything under it
+#define PROJ_SKIP -2  // skip the value without building it
+
+// Every block starts with its own header so the pool is an intrusive list and
+// growing it never copies anything. Allocations bump cur upwards towards end.
 typedef struct arena {
+  struct arena *next;
   char *beg;
+  char *cur;
   char *end;
 } Arena; 
 
 struct json_parser {
+  // Only the byte offset is kept per byte. Newlines are counted where
+  // whitespace is skipped, the column is derived from the offset on demand.
+  ptrdiff_t offset;
+  ptrdiff_t line_start;  // offset just past the last newline
   int line_num;
-  int char_num;
   int max_depth;
   int flags;
-  struct {Arena* arenas; ptrdiff_t len; ptrdiff_t cap;} pool;
+  struct {
+    Arena *head;  // general blocks in the order they were made
+    Arena *cur;   // the block allocations are bumped from
+    Arena *big;   // dedicated blocks for allocations of ARENA_BIG_ALLOC or more
+    char *last;   // start of the most recent allocation in cur, if any
+    ptrdiff_t next_size;
+    ptrdiff_t reserved;   // bytes in all blocks, for json_parser_memory
+    ptrdiff_t peak;       // most bytes ever reserved at once
+    ptrdiff_t abandoned;  // bytes left behind by allocations that moved to grow
+  } pool;
+  ptrdiff_t arena_high_water;
+  // element counts of every container in preorder, filled by the counting pass
+  struct {ptrdiff_t *arr; ptrdiff_t len; ptrdiff_t cap; ptrdiff_t next;} sizes;
+  struct {ptrdiff_t *arr; ptrdiff_t len; ptrdiff_t cap;} open;
+  // children of the open containers in the scratch build mode, keys only come
+  // from object members so they have their own stack
+  struct {
+    struct json_ast_node *vals; ptrdiff_t len; ptrdiff_t cap;
+    ustring *keys; ptrdiff_t keys_len; ptrdiff_t keys_cap;
+  } scratch;
+  struct {struct json_frame *arr; ptrdiff_t len; ptrdiff_t cap;} stack;
+  // running average element counts in sixteenths, plus one so 0 means none
+  // seen yet. Kept across resets.
+  ptrdiff_t learned[LEARN_SLOTS];
+  // json_parser_set_projection, keys points into bytes
+  struct {struct json_proj *arr; ptrdiff_t len; ptrdiff_t cap; unsigned char *bytes;} proj;
+#ifdef JP_STATS
+  struct json_stats stats;
+#endif
   
   struct json_source  source;
   struct json_allocator allocator;
   struct json_ast_node json_node;
 };
 
+static ptrdiff_t
+align_size(ptrdiff_t sz)
+{
+  ptrdiff_t align = alignof(max_align_t);
+  return sz + (align - sz % align)%align;
+}
+
+// Blocks released by parsers wait here for the next parser on the same
+// thread instead of going back to the allocator. A cached block keeps its
+// allocator at beg and only serves parsers using the same one. Off until
+// json_block_cache_set_cap gives it room.
+static _Thread_local struct {
+  Arena *head;
+  ptrdiff_t bytes;
+  ptrdiff_t cap;
+} block_cache;
+
+#ifndef __STDC_NO_THREADS__
+// Empties the cache of a thread when it exits, the key only gets a value on
+// threads that turned the cache on.
+static tss_t block_cache_key;
+static bool block_cache_key_ok;
+static once_flag block_cache_once = ONCE_FLAG_INIT;
+
+static void
+block_cache_exit(void *unused)
+{
+  (void)unused;
+  json_block_cache_set_cap(0);
+}
+
+static void
+block_cache_key_create(void)
+{
+  block_cache_key_ok = tss_create(&block_cache_key, block_cache_exit) == thrd_success;
+}
+#endif
+
+static bool
+same_allocator(struct json_allocator a, struct json_allocator b)
+{
+  return a.al_malloc == b.al_malloc && a.al_free == b.al_free && a.ctx == b.ctx;
+}
+
+// Takes the smallest cached block of at least sz bytes from al.
+static Arena *
+block_cache_take(struct json_allocator al, ptrdiff_t sz)
+{
+  Arena **best = NULL;
+  for (Arena **link = &block_cache.head; *link; link = &(*link)->next) {
+    Arena *a = *link;
+    struct json_allocator owner;
+    memcpy(&owner, a->beg, sizeof(owner));
+    if (a->end - a->beg >= sz && same_allocator(owner, al)
+        && (best == NULL || a->end - a->beg < (*best)->end - (*best)->beg)) {
+      best = link;
+    }
+  }
+  if (best == NULL) return NULL;
+  Arena *a = *best;
+  *best = a->next;
+  block_cache.bytes -= a->end - a->beg;
+  return a;
+}
+
+static bool
+block_cache_put(struct json_allocator al, Arena *a)
+{
+  // compacted blocks can be smaller than anything the pool asks for
+  if (a->end - a->beg < ARENA_BIG_ALLOC) return false;
+  if (block_cache.bytes + (a->end - a->beg) > block_cache.cap) return false;
+  memcpy(a->beg, &al, sizeof(al));
+  a->next = block_cache.head;
+  block_cache.head = a;
+  block_cache.bytes += a->end - a->beg;
+  return true;
+}
+
+static Arena *
+arena_new_block(struct json_parser ctx[static 1], ptrdiff_t sz)
+{
+  Arena *a = block_cache_take(ctx->allocator, sz);
+  if (a == NULL) {
+    ptrdiff_t hdr = align_size(sizeof(Arena));
+    a = ctx->allocator.al_malloc(hdr + sz, ctx->allocator.ctx);
+    if (a == NULL) return NULL;
+    JP_STAT(++ctx->stats.arena_blocks);
+    JP_STAT(ctx->stats.arena_bytes += sz);
+    a->beg = (char *)a + hdr;
+    a->end = a->beg + sz;
+  }
+  ctx->pool.reserved += a->end - a->beg;
+  if (ctx->pool.reserved > ctx->pool.peak) ctx->pool.peak = ctx->pool.reserved;
+  a->next = NULL;
+  a->cur = a->beg;
+  return a;
+}
+
 static void
-arena_push_back(struct json_parser ctx[static 1], Arena a)
+arena_free_list(struct json_parser ctx[static 1], Arena *a)
 {
-  if (ctx->pool.len >= ctx->pool.cap) {
-    ptrdiff_t new_cap = ctx->pool.cap == 0 ? 1 : ctx->pool.cap * 2;
-    Arena *tmp = ctx->allocator.al_malloc(new_cap*sizeof(Arena), ctx->allocator.ctx);
-    memset(tmp, 0, new_cap*sizeof(Arena));
-    memcpy(tmp, ctx->pool.arenas, ctx->pool.cap*sizeof(Arena));
-    ctx->allocator.al_free(ctx->pool.arenas, ctx->allocator.ctx);
-    ctx->pool.arenas = tmp;
-    ctx->pool.cap = new_cap;
+  while (a) {
+    Arena *next = a->next;
+    ctx->pool.reserved -= a->end - a->beg;
+    if (!block_cache_put(ctx->allocator, a)) ctx->allocator.al_free(a, ctx->allocator.ctx);
+    a = next;
   }
-  ctx->pool.arenas[ctx->pool.len++] = a;
 }
 
-static ptrdiff_t
-make_or_find_arena(ptrdiff_t sz, struct json_parser ctx[static 1])
+static void *
+parser_malloc_slow(struct json_parser ctx[static 1], ptrdiff_t sz)
 {
-  for (ptrdiff_t i = 0; i < ctx->pool.len; ++i)
-    if (sz <= ctx->pool.arenas[i].end - ctx->pool.arenas[i].beg)
-      return i;
+  if (sz >= ARENA_BIG_ALLOC) {
+    Arena *a = arena_new_block(ctx, sz);
+    if (a == NULL) return NULL;
+    a->cur = a->end;
+    a->next = ctx->pool.big;
+    ctx->pool.big = a;
+    ctx->pool.last = NULL;
+    return a->beg;
+  }
 
-  Arena a = {0};
-  ptrdiff_t arena_sz = sz < INIT_ARENA_SIZE ? INIT_ARENA_SIZE : sz;
-  a.beg = ctx->allocator.al_malloc(arena_sz, ctx->allocator.ctx);
-  a.end = a.beg + arena_sz;
-  if (a.beg == NULL) {
-    return -1;
+  // Blocks after cur are the rewound ones kept by json_parser_reset
+  Arena *cur = ctx->pool.cur;
+  Arena *a = cur ? cur->next : ctx->pool.head;
+  if (a == NULL || sz > a->end - a->cur) {
+    a = arena_new_block(ctx, ctx->pool.next_size);
+    if (a == NULL) return NULL;
+    if (ctx->pool.next_size < MAX_ARENA_SIZE) ctx->pool.next_size *= 2;
+    if (cur) {
+      a->next = cur->next;
+      cur->next = a;
+    } else {
+      a->next = ctx->pool.head;
+      ctx->pool.head = a;
+    }
   }
-  
-  arena_push_back(ctx, a);
-  return ctx->pool.len - 1;
+  ctx->pool.cur = a;
+  ctx->pool.last = a->cur;
+  a->cur += sz;
+  return ctx->pool.last;
 }
 
 static void *
 parser_malloc(struct json_parser ctx[static 1], ptrdiff_t sz)
 {
   if (sz <= 0) return NULL;
-  int align = alignof(max_align_t);
-  sz = sz + (align - sz % align)%align;
-  
-  ptrdiff_t i = make_or_find_arena(sz, ctx);
-  if (i < 0) {
-    return NULL;
+  sz = align_size(sz);
+
+  Arena *a = ctx->pool.cur;
+  if (a && sz <= a->end - a->cur) {
+    ctx->pool.last = a->cur;
+    a->cur += sz;
+    return ctx->pool.last;
+  }
+  return parser_malloc_slow(ctx, sz);
+}
+
+// Grows an allocation from old_sz to new_sz bytes. The most recent allocation
+// is extended in place while its block has room, anything else is copied into
+// a new allocation and the old one is left behind in the arena.
+static void *
+parser_realloc(struct json_parser ctx[static 1], void *ptr, ptrdiff_t old_sz, ptrdiff_t new_sz)
+{
+  if (ptr != NULL && ptr == ctx->pool.last) {
+    Arena *a = ctx->pool.cur;
+    ptrdiff_t sz = align_size(new_sz);
+    if (sz <= a->end - ctx->pool.last) {
+      a->cur = ctx->pool.last + sz;
+      return ptr;
+    }
+  }
+  void *mem = parser_malloc(ctx, new_sz);
+  if (mem != NULL && ptr != NULL) {
+    memcpy(mem, ptr, old_sz);
+    ctx->pool.abandoned += align_size(old_sz);
+    JP_STAT(++ctx->stats.copies);
+    JP_STAT(ctx->stats.bytes_copied += old_sz);
   }
-  void *mem = ctx->pool.arenas[i].end - sz;
-  ctx->pool.arenas[i].end -= sz;
   return mem;
 }
 
+// Gives the unused tail of the most recent allocation back to its block.
+static void
+parser_trim(struct json_parser ctx[static 1], void *ptr, ptrdiff_t sz)
+{
+  if (ptr != NULL && ptr == ctx->pool.last) {
+    ctx->pool.cur->cur = ctx->pool.last + align_size(sz);
+  }
+}
+
 typedef struct {
   ptrdiff_t len;
   ptrdiff_t cap;
@@ -139,17 +370,16 @@ typedef struct {
 static bool
 sb_append_char(String_Builder *sb, unsigned char c, struct json_parser *ctx)
 {
+  JP_STAT(++ctx->stats.string_appends);
   if (sb->len >= sb->cap -1) {
     ptrdiff_t new_cap = sb->cap == 0 ? 64 : 2*sb->cap;
-    unsigned char *tmp = parser_malloc(ctx, new_cap);
-    memset(tmp, 0, new_cap);
+    unsigned char *tmp = parser_realloc(ctx, sb->str, sb->cap, new_cap);
     if (tmp == NULL) {
       // Allocation failure start the cleanup
       sb->cap = 0;
       sb->len = 0;
       return false;
     }
-    if (sb->str) memcpy(tmp, sb->str, sb->cap);
     sb->str = tmp;
     sb->cap = new_cap;
   }
@@ -159,8 +389,10 @@ sb_append_char(String_Builder *sb, unsigned char c, struct json_parser *ctx)
 }
 
 static ustring
-sb_tostr(String_Builder *sb)
+sb_tostr(String_Builder *sb, struct json_parser *ctx)
 {
+  // keep the terminating NUL, release the rest of the buffer
+  parser_trim(ctx, sb->str, sb->len + 1);
   ustring res = (ustring) { .s = sb->str, .len = sb->len };
   sb->cap = 0;
   sb->len = 0;
@@ -418,6 +650,10 @@ static char err_lookup_table[JSON_ERR_ENUM_SIZE][128] = {
   [JSON_ERR_DOUBLE_EXPONENT] = "ERROR::More than one exponent not allowed in a number.",
   [JSON_ERR_CATCH_ALL] = "ERROR::I have no idea but something went really wrong.",
   [JSON_ERR_OOM] = "ERROR::Cannot allocate more memory stopping everything.",
+  [JSON_ERR_MAX_DEPTH] = "ERROR::Maximum nesting depth exceeded.",
+  [JSON_ERR_TYPE_MISMATCH] = "ERROR::Value does not match the type of its field.",
+  [JSON_ERR_MISSING_FIELD] = "ERROR::A required field is missing.",
+  [JSON_ERR_TOO_MANY_FIELDS] = "ERROR::A struct description has more than 64 fields.",
 };
 
 static unsigned char
@@ -426,12 +662,7 @@ get_byte(struct json_parser *p);
 static void
 next_byte(struct json_parser *p)
 {
-  if (get_byte(p) == '\n') {
-    ++p->line_num;
-    p->char_num = 0;
-  } else {
-    ++p->char_num;
-  }
+  ++p->offset;
   p->source.next(p->source.ctx);
 }
 
@@ -451,17 +682,17 @@ static bool
 json_vec_append(struct json_arr *arr, struct json_ast_node node, struct json_parser *ctx)
 {
   if (arr->cap <= arr->len) {
+    JP_STAT(++ctx->stats.container_grows);
     ptrdiff_t old_cap = arr->cap;
     ptrdiff_t new_cap = (arr->cap == 0 ? 64 : 2*(arr->cap));
-    void *tmp = parser_malloc(ctx, new_cap*sizeof(struct json_ast_node));
+    void *tmp = parser_realloc(ctx, arr->arr, old_cap*sizeof(struct json_ast_node),
+                               new_cap*sizeof(struct json_ast_node));
     if (tmp == NULL) {
       arr->arr = NULL;
       arr->len = 0;
       arr->cap = 0;
       return false;
     }
-    memset(tmp, 0, new_cap*sizeof(struct json_ast_node));
-    if (arr->arr) memcpy(tmp, arr->arr, old_cap*sizeof(struct json_ast_node));
     arr->arr = tmp;
     arr->cap = new_cap;
   }
@@ -473,9 +704,20 @@ static bool
 json_obj_append(struct json_fields *obj, ustring key, struct json_ast_node val, struct json_parser *ctx)
 {
   if (obj->cap <= obj->len) {
+    JP_STAT(++ctx->stats.container_grows);
     ptrdiff_t new_cap = obj->cap == 0 ? 8 : 2*(obj->cap);
-    void *tmp_keys = parser_malloc(ctx, sizeof(key)*(new_cap));
-    void *tmp_vals = parser_malloc(ctx, sizeof(val)*(new_cap));
+    // keys and vals are separate allocations and at most one of them, the
+    // most recent, can grow in place. Grow that one first, the other is copied
+    // and leaves its old space behind.
+    void *tmp_keys = NULL;
+    void *tmp_vals = NULL;
+    if ((char *)obj->keys == ctx->pool.last) {
+      tmp_keys = parser_realloc(ctx, obj->keys, sizeof(key)*(obj->cap), sizeof(key)*(new_cap));
+      tmp_vals = parser_realloc(ctx, obj->vals, sizeof(val)*(obj->cap), sizeof(val)*(new_cap));
+    } else {
+      tmp_vals = parser_realloc(ctx, obj->vals, sizeof(val)*(obj->cap), sizeof(val)*(new_cap));
+      tmp_keys = parser_realloc(ctx, obj->keys, sizeof(key)*(obj->cap), sizeof(key)*(new_cap));
+    }
     if (!(tmp_keys && tmp_vals)) {
       obj->keys = NULL;
       obj->vals = NULL;
@@ -483,10 +725,6 @@ json_obj_append(struct json_fields *obj, ustring key, struct json_ast_node val,
       obj->cap = 0;
       return false;
     }
-    memset(tmp_keys, 0, new_cap*sizeof(key));
-    memset(tmp_vals, 0, new_cap*sizeof(val));
-    if (obj->keys) memcpy(tmp_keys, obj->keys, obj->cap*sizeof(key));
-    if (obj->vals) memcpy(tmp_vals, obj->vals, obj->cap*sizeof(val));
     obj->keys = tmp_keys;
     obj->vals = tmp_vals;
     obj->cap = new_cap;
@@ -497,35 +735,407 @@ json_obj_append(struct json_fields *obj, ustring key, struct json_ast_node val,
   return true;
 }
 
+// Grows a scratch array that lives outside the arenas, it is kept across
+// parses and released in destroy_parser.
+static void *
+al_grow(struct json_parser ctx[static 1], void *ptr, ptrdiff_t *cap, ptrdiff_t elem_sz)
+{
+  ptrdiff_t new_cap = *cap == 0 ? 64 : 2*(*cap);
+  void *tmp = ctx->allocator.al_malloc(new_cap*elem_sz, ctx->allocator.ctx);
+  if (tmp == NULL) return NULL;
+  if (ptr) {
+    memcpy(tmp, ptr, (*cap)*elem_sz);
+    ctx->allocator.al_free(ptr, ctx->allocator.ctx);
+  }
+  *cap = new_cap;
+  return tmp;
+}
+
+// First pass of the exact size mode. Walks the whole source once and records
+// the element count of every array and object in the order they are opened,
+// the parse then allocates each container once at its final size. Malformed
+// input only makes the counts wrong, the parser still grows when it has to.
+static bool
+count_containers(struct json_parser ctx[static 1])
+{
+  ctx->sizes.len = 0;
+  ctx->sizes.next = 0;
+  ctx->open.len = 0;
+  bool in_string = false;
+  bool escaped = false;
+  while (has_next_byte(ctx)) {
+    unsigned char c = get_byte(ctx);
+    ctx->source.next(ctx->source.ctx);
+    if (in_string) {
+      if (escaped) escaped = false;
+      else if (c == '\\') escaped = true;
+      else if (c == '"') in_string = false;
+      continue;
+    }
+    switch (c) {
+    case ' ': case '\t': case '\n': case '\r': case ':':
+      continue;
+    case ',':
+      if (ctx->open.len) ++ctx->sizes.arr[ctx->open.arr[ctx->open.len - 1]];
+      continue;
+    case ']': case '}':
+      if (ctx->open.len) --ctx->open.len;
+      continue;
+    default:
+      break;
+    }
+    // c starts or continues a value, the first one makes its parent non empty
+    if (ctx->open.len && ctx->sizes.arr[ctx->open.arr[ctx->open.len - 1]] == 0)
+      ctx->sizes.arr[ctx->open.arr[ctx->open.len - 1]] = 1;
+    if (c == '"') {
+      in_string = true;
+    } else if (c == '[' || c == '{') {
+      if (ctx->sizes.len >= ctx->sizes.cap) {
+        ptrdiff_t *tmp = al_grow(ctx, ctx->sizes.arr, &ctx->sizes.cap, sizeof(ptrdiff_t));
+        if (tmp == NULL) return false;
+        ctx->sizes.arr = tmp;
+      }
+      if (ctx->open.len >= ctx->open.cap) {
+        ptrdiff_t *tmp = al_grow(ctx, ctx->open.arr, &ctx->open.cap, sizeof(ptrdiff_t));
+        if (tmp == NULL) return false;
+        ctx->open.arr = tmp;
+      }
+      ctx->sizes.arr[ctx->sizes.len] = 0;
+      ctx->open.arr[ctx->open.len++] = ctx->sizes.len++;
+    }
+  }
+  ctx->source.rewind(ctx->source.ctx);
+  return true;
+}
+
+// Element count recorded for the next container to be opened, 0 when unknown
+static ptrdiff_t
+next_container_size(struct json_parser ctx[static 1])
+{
+  if (ctx->sizes.next < ctx->sizes.len) return ctx->sizes.arr[ctx->sizes.next++];
+  return 0;
+}
+
+static void
+json_vec_reserve(struct json_arr *arr, ptrdiff_t n, struct json_parser *ctx)
+{
+  if (n <= 0) return;
+  arr->arr = parser_malloc(ctx, n*sizeof(struct json_ast_node));
+  arr->cap = arr->arr ? n : 0;
+}
+
+static void
+json_obj_reserve(struct json_fields *obj, ptrdiff_t n, struct json_parser *ctx)
+{
+  if (n <= 0) return;
+  obj->keys = parser_malloc(ctx, n*sizeof(ustring));
+  obj->vals = parser_malloc(ctx, n*sizeof(struct json_ast_node));
+  obj->cap = obj->keys && obj->vals ? n : 0;
+}
+
+// key is NULL for array elements.
+static bool
+scratch_push(struct json_parser ctx[static 1], const ustring *key, struct json_ast_node val)
+{
+  if (ctx->scratch.len >= ctx->scratch.cap) {
+    struct json_ast_node *vals = al_grow(ctx, ctx->scratch.vals, &ctx->scratch.cap, sizeof(struct json_ast_node));
+    if (vals == NULL) return false;
+    ctx->scratch.vals = vals;
+  }
+  if (key && ctx->scratch.keys_len >= ctx->scratch.keys_cap) {
+    ustring *keys = al_grow(ctx, ctx->scratch.keys, &ctx->scratch.keys_cap, sizeof(ustring));
+    if (keys == NULL) return false;
+    ctx->scratch.keys = keys;
+  }
+  if (key) ctx->scratch.keys[ctx->scratch.keys_len++] = *key;
+  ctx->scratch.vals[ctx->scratch.len++] = val;
+  return true;
+}
+
+// Copies the children pushed since base into an exact size array in the arena
+// and pops them off the scratch stack.
+static bool
+scratch_pop_array(struct json_parser ctx[static 1], ptrdiff_t base, struct json_arr *arr)
+{
+  ptrdiff_t n = ctx->scratch.len - base;
+  arr->arr = parser_malloc(ctx, n*sizeof(struct json_ast_node));
+  if (arr->arr == NULL) return false;
+  memcpy(arr->arr, ctx->scratch.vals + base, n*sizeof(struct json_ast_node));
+  arr->len = arr->cap = n;
+  ctx->scratch.len = base;
+  return true;
+}
+
+// Children of open containers are popped before the object's next member is
+// pushed, so its keys are the last n on the key stack.
+static bool
+scratch_pop_object(struct json_parser ctx[static 1], ptrdiff_t base, struct json_fields *obj)
+{
+  ptrdiff_t n = ctx->scratch.len - base;
+  obj->keys = parser_malloc(ctx, n*sizeof(ustring));
+  obj->vals = parser_malloc(ctx, n*sizeof(struct json_ast_node));
+  if (obj->keys == NULL || obj->vals == NULL) return false;
+  ctx->scratch.keys_len -= n;
+  memcpy(obj->keys, ctx->scratch.keys + ctx->scratch.keys_len, n*sizeof(ustring));
+  memcpy(obj->vals, ctx->scratch.vals + base, n*sizeof(struct json_ast_node));
+  obj->len = obj->cap = n;
+  ctx->scratch.len = base;
+  return true;
+}
+
 static bool is_ws(char c) { return c == ' ' || c == '\n' || c == '\r' || c == '\t'; }
 
+// Newlines are only valid between tokens, so this is the one place they are
+// counted for json_parser_linenum.
 static void
 skip_whitespace(struct json_parser ctx[static 1])
 {
-  while(has_next_byte(ctx) && is_ws(get_byte(ctx))) next_byte(ctx);
+  while (has_next_byte(ctx)) {
+    unsigned char c = get_byte(ctx);
+    if (!is_ws(c)) return;
+    if (c == '\n') {
+      ++ctx->line_num;
+      ctx->line_start = ctx->offset + 1;
+    }
+    next_byte(ctx);
+  }
+}
+// Skips one value without building anything and stops on the byte after it.
+// Only strings and brackets are tracked, the skipped bytes are not validated.
+// Adds the arrays and objects it went past to opened when that is not NULL.
+static bool
+skip_json_value(struct json_parser ctx[static 1], ptrdiff_t *opened)
+{
+  ptrdiff_t depth = 0;
+  skip_whitespace(ctx);
+  while (has_next_byte(ctx)) {
+    unsigned char c = get_byte(ctx);
+    switch (c) {
+    case '"':
+      next_byte(ctx);
+      while (has_next_byte(ctx) && get_byte(ctx) != '"') {
+        if (get_byte(ctx) == '\\') next_byte(ctx);
+        next_byte(ctx);
+      }
+      if (!has_next_byte(ctx)) return false;
+      next_byte(ctx);
+      if (depth == 0) return true;
+      break;
+    case '[': case '{':
+      ++depth;
+      if (opened) ++*opened;
+      next_byte(ctx);
+      break;
+    case ']': case '}':
+      if (depth == 0) return true;
+      next_byte(ctx);
+      if (--depth == 0) return true;
+      break;
+    case ' ': case '\t': case '\r': case '\n':
+      if (depth == 0) return true;
+      skip_whitespace(ctx);
+      break;
+    case ',':
+      if (depth == 0) return true;
+      next_byte(ctx);
+      break;
+    default:
+      next_byte(ctx);
+      break;
+    }
+  }
+  return depth == 0;
 }
+
 static struct json_ast_node parse_base_value(struct json_parser ctx[static 1]);
-static struct json_ast_node parse_array(struct json_parser ctx[static 1]);
-static struct json_ast_node parse_object(struct json_parser ctx[static 1]);
 static struct json_ast_node make_json_error(enum json_err err_code);
 static struct json_ast_node make_json_null();
 
 static struct json_ast_node
-parse_json_value(struct json_parser ctx[static 1])
+make_json_empty_object(void)
 {
-  skip_whitespace(ctx);
-  if (ctx->max_depth == 0) {
-      return make_json_error(JSON_ERR_OOM);
+  struct json_ast_node node = {.type = JSON_OBJECT};
+  return node;
+}
+
+static struct json_ast_node
+make_json_empty_array(void)
+{
+  struct json_ast_node node = { .type = JSON_ARRAY };
+  return node;
+}
+
+// FNV-1a over the depth, type and parent key of the container on top of the
+// stack.
+static ptrdiff_t
+learn_slot(struct json_parser ctx[static 1], Json_Type type)
+{
+  uint32_t h = 2166136261u;
+  h = (h ^ (uint32_t)ctx->stack.len) * 16777619u;
+  h = (h ^ (uint32_t)type) * 16777619u;
+  if (ctx->stack.len >= 2) {
+    struct json_frame *parent = &ctx->stack.arr[ctx->stack.len - 2];
+    if (parent->node.type == JSON_OBJECT) {
+      for (ptrdiff_t i = 0; i < parent->key.len; ++i) h = (h ^ parent->key.s[i]) * 16777619u;
+    }
+  }
+  return h % LEARN_SLOTS;
+}
+
+// Moves the average towards the size of a closed container and gives the
+// reservation it didn't fill back to the arena when nothing came after it.
+static void
+learn_size(struct json_parser ctx[static 1], struct json_frame *f)
+{
+  struct json_ast_node *node = &(f->node);
+  ptrdiff_t len = node->type == JSON_ARRAY ? node->value.vec.len : node->value.obj.len;
+  ptrdiff_t *avg = &ctx->learned[f->learn];
+  *avg = *avg == 0 ? 16*len + 1 : *avg + (16*len - *avg)/4;
+
+  if (node->type == JSON_ARRAY) {
+    struct json_arr *arr = &(node->value.vec);
+    if (arr->arr == NULL || (char *)arr->arr != ctx->pool.last) return;
+    parser_trim(ctx, arr->arr, arr->len*sizeof(struct json_ast_node));
+    arr->cap = arr->len;
+    if (arr->len == 0) arr->arr = NULL;
+  } else {
+    // keys came first, only the slack of vals can be returned
+    struct json_fields *obj = &(node->value.obj);
+    if (obj->vals == NULL || (char *)obj->vals != ctx->pool.last) return;
+    parser_trim(ctx, obj->vals, obj->len*sizeof(struct json_ast_node));
+    obj->cap = obj->len;
+    if (obj->len == 0) {
+      obj->keys = NULL;
+      obj->vals = NULL;
     }
-  if (ctx->max_depth > 0) --ctx->max_depth;
+  }
+}
+
+static bool ustreq(const ustring a, const ustring b);
+
+// Where the next value of the open container f goes in the projection: the
+// child matching its key, or * in objects and arrays alike. An exact key wins
+// over *, a value the paths go deeper than is only kept at the root.
+static ptrdiff_t
+proj_find(struct json_parser ctx[static 1], struct json_frame *f)
+{
+  if (f->proj == PROJ_ALL) return PROJ_ALL;
+  ptrdiff_t any = PROJ_SKIP;
+  for (ptrdiff_t c = ctx->proj.arr[f->proj].child; c >= 0; c = ctx->proj.arr[c].sibling) {
+    const struct json_proj *j = &ctx->proj.arr[c];
+    if (f->node.type == JSON_OBJECT && ustreq(j->key, f->key)) return j->keep ? PROJ_ALL : c;
+    if (j->key.len == 1 && j->key.s[0] == '*') any = j->keep ? PROJ_ALL : c;
+  }
+  return any;
+}
+
+// Most values a container at projection node proj can keep: all of them
+// under *, otherwise one per key for objects and none for arrays.
+static ptrdiff_t
+proj_width(struct json_parser ctx[static 1], ptrdiff_t proj, Json_Type type)
+{
+  if (proj == PROJ_ALL) return PTRDIFF_MAX;
+  ptrdiff_t keys = 0;
+  for (ptrdiff_t c = ctx->proj.arr[proj].child; c >= 0; c = ctx->proj.arr[c].sibling) {
+    const struct json_proj *j = &ctx->proj.arr[c];
+    if (j->key.len == 1 && j->key.s[0] == '*') return PTRDIFF_MAX;
+    ++keys;
+  }
+  return type == JSON_OBJECT ? keys : 0;
+}
+
+static struct json_frame *
+push_frame(struct json_parser ctx[static 1], struct json_ast_node node, ptrdiff_t proj)
+{
+  if (ctx->stack.len >= ctx->stack.cap) {
+    struct json_frame *tmp = al_grow(ctx, ctx->stack.arr, &ctx->stack.cap, sizeof(struct json_frame));
+    if (tmp == NULL) return NULL;
+    ctx->stack.arr = tmp;
+  }
+  struct json_frame *f = &ctx->stack.arr[ctx->stack.len++];
+  JP_STAT(ctx->stats.peak_depth = ctx->stack.len > ctx->stats.peak_depth ? ctx->stack.len : ctx->stats.peak_depth);
+  f->node = node;
+  f->key = (ustring){0};
+  f->base = ctx->scratch.len;
+  f->learn = 0;
+  f->proj = proj;
+  ptrdiff_t size = 0;
+  if (ctx->flags & JP_FLAG_EXACT_SIZE) {
+    // the count includes values the projection skips
+    size = next_container_size(ctx);
+    ptrdiff_t width = proj_width(ctx, proj, node.type);
+    if (size > width) size = width;
+  } else if (ctx->flags & JP_FLAG_ADAPTIVE) {
+    f->learn = learn_slot(ctx, node.type);
+    size = (ctx->learned[f->learn] + 8)/16;
+  }
+  if ((ctx->flags & JP_FLAG_SCRATCH) == 0) {
+    if (node.type == JSON_ARRAY) json_vec_reserve(&(f->node.value.vec), size, ctx);
+    else json_obj_reserve(&(f->node.value.obj), size, ctx);
+  }
+  return f;
+}
+
+static bool
+frame_append(struct json_parser ctx[static 1], struct json_frame *f, struct json_ast_node val)
+{
+  if (ctx->flags & JP_FLAG_SCRATCH) return scratch_push(ctx, f->node.type == JSON_OBJECT ? &f->key : NULL, val);
+  if (f->node.type == JSON_ARRAY) return json_vec_append(&(f->node.value.vec), val, ctx);
+  return json_obj_append(&(f->node.value.obj), f->key, val, ctx);
+}
+
+static bool
+frame_close(struct json_parser ctx[static 1], struct json_frame *f)
+{
+  if ((ctx->flags & (JP_FLAG_SCRATCH | JP_FLAG_EXACT_SIZE | JP_FLAG_ADAPTIVE)) == JP_FLAG_ADAPTIVE) {
+    learn_size(ctx, f);
+  }
+  if ((ctx->flags & JP_FLAG_SCRATCH) == 0 || ctx->scratch.len == f->base) return true;
+  if (f->node.type == JSON_ARRAY) return scratch_pop_array(ctx, f->base, &(f->node.value.vec));
+  return scratch_pop_object(ctx, f->base, &(f->node.value.obj));
+}
+
+// Parses one value without recursing. Open containers live on ctx->stack, so
+// nesting is only limited by max_depth and memory, never by the C stack.
+// proj is the projection node of the value, values it leaves out are skipped
+// without building them.
+static struct json_ast_node
+parse_json_value(struct json_parser ctx[static 1], ptrdiff_t proj)
+{
+  ptrdiff_t bottom = ctx->stack.len;
   struct json_ast_node node;
+  struct json_frame *f;
+  skip_whitespace(ctx);
+
+ value:
+  if (ctx->max_depth >= 0 && ctx->stack.len - bottom >= ctx->max_depth) {
+    node = make_json_error(JSON_ERR_MAX_DEPTH);
+    goto fail;
+  }
+  if (ctx->stack.len > bottom) proj = proj_find(ctx, &ctx->stack.arr[ctx->stack.len - 1]);
   switch(get_byte(ctx)) {
   case '{':
-    node = parse_object(ctx);
-    break;
+    if (proj == PROJ_SKIP) goto skip;
+    f = push_frame(ctx, make_json_empty_object(), proj);
+    if (f == NULL) {
+      node = make_json_error(JSON_ERR_OOM);
+      goto fail;
+    }
+    next_byte(ctx);
+    skip_whitespace(ctx);
+    if (get_byte(ctx) == '}') goto close;
+    goto key;
   case '[':
-    node = parse_array(ctx);
-    break;
+    if (proj == PROJ_SKIP) goto skip;
+    f = push_frame(ctx, make_json_empty_array(), proj);
+    if (f == NULL) {
+      node = make_json_error(JSON_ERR_OOM);
+      goto fail;
+    }
+    next_byte(ctx);
+    skip_whitespace(ctx);
+    if (get_byte(ctx) == ']') goto close;
+    goto element;
   case '"':
   case '-':
   case '0':
@@ -541,141 +1151,113 @@ parse_json_value(struct json_parser ctx[static 1])
   case 'n':
   case 't':
   case 'f':
+    if (proj != PROJ_ALL && ctx->stack.len > bottom) goto skip;
     node = parse_base_value(ctx);
+    if (node.type == JSON_ERROR) goto fail;
     break;
   default:
     node = make_json_error(JSON_ERR_INVALID_START);
-    break;
+    goto fail;
   }
-  if (ctx->max_depth > 0) ++ctx->max_depth;
-  return node;
-}
-
-static struct json_ast_node
-make_json_empty_object(void)
-{
-  struct json_ast_node node = {.type = JSON_OBJECT};
-  return node;
-}
-
-static struct json_ast_node
-make_json_empty_array(void)
-{
-  struct json_ast_node node = { .type = JSON_ARRAY };
-  return node;
-}
-
 
-static struct json_ast_node
-parse_object(struct json_parser ctx[static 1])
-{
-  if (get_byte(ctx) == '{') {
+ done:
+  if (ctx->stack.len == bottom) return node;
+  f = &ctx->stack.arr[ctx->stack.len - 1];
+  if (!frame_append(ctx, f, node)) {
+    node = make_json_error(JSON_ERR_OOM);
+    goto fail;
+  }
+  if (node.type != JSON_NUMBER) {
     next_byte(ctx);
-    skip_whitespace(ctx);
-    if (get_byte(ctx) == '}') return make_json_empty_object();
-    else {
-      struct json_ast_node obj_node = make_json_empty_object();
-      while (has_next_byte(ctx)) {
-        switch (get_byte(ctx)) {
-        case '"': {
-          struct json_ast_node key_node = parse_base_value(ctx);
-          if (key_node.type == JSON_ERROR) {
-            return key_node;
-          }
-          next_byte(ctx);
-          skip_whitespace(ctx);
-
-          if (get_byte(ctx) != ':') {
-            return make_json_error(JSON_ERR_COLON_NOT_FOUND);
-          }
-
-          next_byte(ctx);
-          skip_whitespace(ctx);
-        
-          struct json_ast_node val_node = parse_json_value(ctx);
-          if (val_node.type == JSON_ERROR) {
-            return val_node;
-          }
-          ustring key = key_node.value.s;
-          key_node.value.s.s = NULL;
-          key_node.value.s.len = 0;
-          json_obj_append(&(obj_node.value.obj), key, val_node, ctx);
-          
-          if (val_node.type != JSON_NUMBER) {
-            next_byte(ctx);
-          }
-          skip_whitespace(ctx);
-          
-          val_node = (struct json_ast_node){0};
-
-          if (get_byte(ctx) == ',') {
-            next_byte(ctx);
-            skip_whitespace(ctx);
-          } else if (get_byte(ctx) == '}') {
-            return obj_node;
-          } else {
-            return make_json_error(JSON_ERR_OBJ_TRAILING_COMMA);
-          }
-          
-          break;
-        }
-        default:
-          return make_json_error(JSON_ERR_KEY_NOT_STRING);
-        }
-      }
-      return make_json_error(JSON_ERR_INVALID_END);
+  }
+ next:
+  skip_whitespace(ctx);
+  if (f->node.type == JSON_OBJECT) {
+    if (get_byte(ctx) == ',') {
+      next_byte(ctx);
+      skip_whitespace(ctx);
+      goto key;
+    } else if (get_byte(ctx) == '}') {
+      goto close;
+    }
+    node = make_json_error(JSON_ERR_OBJ_TRAILING_COMMA);
+    goto fail;
+  } else {
+    if (get_byte(ctx) == ',') {
+      next_byte(ctx);
+      skip_whitespace(ctx);
+      goto element;
+    } else if (get_byte(ctx) == ']') {
+      goto close;
     }
+    node = make_json_error(JSON_ERR_INVALID_END);
+    goto fail;
   }
-  else {
-    return make_json_error(JSON_ERR_INVALID_START);
+
+ close:
+  f = &ctx->stack.arr[ctx->stack.len - 1];
+  if (!frame_close(ctx, f)) {
+    node = make_json_error(JSON_ERR_OOM);
+    goto fail;
   }
-}
+  node = f->node;
+  --ctx->stack.len;
+  goto done;
+
+ key:
+  if (!has_next_byte(ctx)) {
+    node = make_json_error(JSON_ERR_INVALID_END);
+    goto fail;
+  }
+  if (get_byte(ctx) != '"') {
+    node = make_json_error(JSON_ERR_KEY_NOT_STRING);
+    goto fail;
+  }
+  node = parse_base_value(ctx);
+  if (node.type == JSON_ERROR) goto fail;
+  ctx->stack.arr[ctx->stack.len - 1].key = node.value.s;
+  next_byte(ctx);
+  skip_whitespace(ctx);
+  if (get_byte(ctx) != ':') {
+    node = make_json_error(JSON_ERR_COLON_NOT_FOUND);
+    goto fail;
+  }
+  next_byte(ctx);
+  skip_whitespace(ctx);
+  goto value;
 
-static struct json_ast_node
-parse_array(struct json_parser ctx[static 1])
-{
-  if (get_byte(ctx) == '[') {
-    next_byte(ctx);
-    skip_whitespace(ctx);
-    if (get_byte(ctx) == ']') return make_json_empty_array();
-    else {
-      struct json_ast_node arr_node = make_json_empty_array();
-      while (has_next_byte(ctx)) {
-        switch (get_byte(ctx)) {
-        case '"': case '-': case 't': case 'f': case 'n':
-        case '0': case '1': case '2': case '3': case '4':
-        case '5': case '6': case '7': case '8': case '9':
-        case '{': case '[':
-          struct json_ast_node val = parse_json_value(ctx);
-          if (val.type == JSON_ERROR) {
-            return val;
-          }
-          json_vec_append(&(arr_node.value.vec), val, ctx);
-
-          if (val.type != JSON_NUMBER) {
-            next_byte(ctx);
-          }
-          skip_whitespace(ctx);
-          break;
-        default:
-          return make_json_error(JSON_ERR_ARR_TRAILING_COMMA);
-        }
-        
-        if (get_byte(ctx) == ',') {
-          next_byte(ctx);
-          skip_whitespace(ctx);  
-        } else if (get_byte(ctx) == ']') {
-          return arr_node;
-        } else {
-          return make_json_error(JSON_ERR_INVALID_END);
-        }
-      }
-      return make_json_error(JSON_ERR_INVALID_END);
-    }
+ element:
+  if (!has_next_byte(ctx)) {
+    node = make_json_error(JSON_ERR_INVALID_END);
+    goto fail;
   }
-  else {
-    return make_json_error(JSON_ERR_INVALID_START);
+  switch (get_byte(ctx)) {
+  case '"': case '-': case 't': case 'f': case 'n':
+  case '0': case '1': case '2': case '3': case '4':
+  case '5': case '6': case '7': case '8': case '9':
+  case '{': case '[':
+    goto value;
+  default:
+    node = make_json_error(JSON_ERR_ARR_TRAILING_COMMA);
+    goto fail;
+  }
+
+ skip:
+  f = &ctx->stack.arr[ctx->stack.len - 1];
+  // the key of a skipped value is not kept either
+  if (f->node.type == JSON_OBJECT) parser_trim(ctx, f->key.s, 0);
+  ptrdiff_t skipped = 0;
+  if (!skip_json_value(ctx, &skipped)) {
+    node = make_json_error(JSON_ERR_INVALID_END);
+    goto fail;
   }
+  // the counting pass recorded sizes for the containers skipped over too
+  if (ctx->flags & JP_FLAG_EXACT_SIZE) ctx->sizes.next += skipped;
+  goto next;
+
+ fail:
+  ctx->stack.len = bottom;
+  return node;
 }
 
 enum json_bv_state {
@@ -759,9 +1341,11 @@ enum json_bv_state {
     JSON_BV_STATE_SIZE
 };
 
-static const enum json_bv_state transition_table[JSON_BV_STATE_SIZE][256] = {
-  #include "bv_transition.table"
-};
+static_assert(JSON_BV_STATE_SIZE <= UINT8_MAX, "states must fit the uint8_t transition table");
+
+// byte_class[] folds the 256 input bytes into the few classes the DFA can
+// tell apart, which keeps transition_table small enough to stay in L1.
+#include "bv_transition.table"
 
 static struct json_ast_node
 make_json_null()
@@ -801,237 +1385,175 @@ make_json_string(ustring str)
   return node;
 }
 
+// Scalars are scanned by the byte-class DFA, dispatching on the merged
+// action of each state rather than on the state itself. String bytes and
+// integer digits stay in their own inner loops, and every ERR_* state leaves
+// through the single exit at the bottom.
+#ifdef __GNUC__
+#define BV_DISPATCH() goto *dispatch[bv_action[state]]
+#else
+#define BV_DISPATCH() goto dispatch_switch
+#endif
+
+// Steps to the next byte and its state, or out of the loop at end of input.
+#define BV_ADVANCE()                                            \
+  do {                                                          \
+    next_byte(ctx);                                             \
+    if (!has_next_byte(ctx)) goto end;                          \
+    c = get_byte(ctx);                                          \
+    state = transition_table[state][byte_class[c]];             \
+    JP_STAT(++ctx->stats.transitions[BV_STATS_CLASS(state)]);   \
+  } while (0)
+
+// The states are laid out literals first, then strings, then numbers.
+#define BV_STATS_CLASS(s)                                       \
+  ((s) < STR_QUOTE_BEGIN ? JSON_STATS_LITERAL                   \
+   : (s) < NUM_MINUS ? JSON_STATS_STRING : JSON_STATS_NUMBER)
+
 static struct json_ast_node
 parse_base_value(struct json_parser ctx[static 1])
 {
-  enum json_bv_state current_state = START;
+  enum json_bv_state state = START;
   String_Builder sb = {0};
   Num_Builder nb = {1, 1, 0, 0, 0, 0, false};
   utf16_builder ub = {0};
   unsigned char c;
-  while (has_next_byte(ctx)) {
-    c = get_byte(ctx);
-    current_state = transition_table[current_state][c];
-    switch (current_state) {
-    case START: break;
-    case ERR_INVALID_START:
-      return make_json_error(JSON_ERR_INVALID_START);
-    case NULL_N: break;
-    case NULL_U: break;
-    case NULL_L1: break;
-    case NULL_L2:
-      return make_json_null();
-      
-    case ERR_EXPECTED_NULL:
-      return make_json_error(JSON_ERR_EXPECTED_NULL);
-    case BOOL_T: break;
-    case BOOL_R: break;
-    case BOOL_U: break;
-    case BOOL_TE:
-      return make_json_bool(true);
-
-    case BOOL_F: break;
-    case BOOL_A: break;
-    case BOOL_L: break;
-    case BOOL_S: break;
-    case BOOL_FE:
-      return make_json_bool(false);
-
-    case ERR_EXPECTED_TRUE:
-      return make_json_error(JSON_ERR_EXPECTED_TRUE);
-    case ERR_EXPECTED_FALSE:
-      return make_json_error(JSON_ERR_EXPECTED_FALSE);
-
-    case STR_QUOTE_BEGIN:
-      break;
+#ifdef __GNUC__
+  static const void *const dispatch[BV_ACTION_SIZE] = {
+    [BV_SKIP] = &&skip, [BV_APPEND] = &&append, [BV_ESCAPE] = &&escape,
+    [BV_HEX] = &&hex, [BV_HEX_END] = &&hex_end, [BV_LSHEX] = &&lshex,
+    [BV_LSHEX_END] = &&lshex_end, [BV_MINUS] = &&minus, [BV_INT] = &&integer,
+    [BV_DECIMAL] = &&decimal, [BV_EXP_MINUS] = &&exp_minus, [BV_EXP] = &&exp,
+    [BV_NULL] = &&null, [BV_TRUE] = &&true_, [BV_FALSE] = &&false_,
+    [BV_STRING] = &&string, [BV_NUMBER] = &&number, [BV_ERROR] = &&fail,
+  };
+#endif
 
-    case STR_UTF_1BYTE:
-      if (!sb_append_char(&sb, c, ctx))
-        return make_json_error(JSON_ERR_OOM);
-      break; 
-    case STR_UTF_2BYTE_1:
-      if (!sb_append_char(&sb, c, ctx))
-        return make_json_error(JSON_ERR_OOM);
-      break;
-    case STR_UTF_2BYTE_2:
-      if (!sb_append_char(&sb, c, ctx))
-        return make_json_error(JSON_ERR_OOM);
-      break;
-    case STR_UTF_3BYTE_1:
-      if (!sb_append_char(&sb, c, ctx))
-        return make_json_error(JSON_ERR_OOM);
-      break;
-    case STR_UTF_3BYTE_2:
-      if (!sb_append_char(&sb, c, ctx))
-        return make_json_error(JSON_ERR_OOM);
-      break;
-    case STR_UTF_3BYTE_3:
-      if (!sb_append_char(&sb, c, ctx))
-        return make_json_error(JSON_ERR_OOM);
-      break;
-    case STR_UTF_4BYTE_1:
-      if (!sb_append_char(&sb, c, ctx))
-        return make_json_error(JSON_ERR_OOM);
-      break;
-    case STR_UTF_4BYTE_2:
-      if (!sb_append_char(&sb, c, ctx))
-        return make_json_error(JSON_ERR_OOM);
-      break;
-    case STR_UTF_4BYTE_3:
-      if (!sb_append_char(&sb, c, ctx))
-        return make_json_error(JSON_ERR_OOM);
-      break;
-    case STR_UTF_4BYTE_4:
-      if (!sb_append_char(&sb, c, ctx))
-        return make_json_error(JSON_ERR_OOM);
-      break;
+  if (!has_next_byte(ctx)) goto end;
+  c = get_byte(ctx);
+  state = transition_table[state][byte_class[c]];
+  JP_STAT(++ctx->stats.transitions[BV_STATS_CLASS(state)]);
+  BV_DISPATCH();
 
-    case ERR_INVALID_UTF8:
-      return make_json_error(JSON_ERR_INVALID_UTF8);
+ skip:
+  BV_ADVANCE();
+  BV_DISPATCH();
 
-    case STR_CONTROL_SLASH: break;
-    case STR_CONTROL_QUOTE:
-      if (!sb_append_char(&sb, '"', ctx))
-        return make_json_error(JSON_ERR_OOM);
-      break;
-    case STR_CONTROL_REVSOL:
-      if (!sb_append_char(&sb, '\\', ctx))
-        return make_json_error(JSON_ERR_OOM);
-      break; 
-    case STR_CONTROL_SOL:
-      if (!sb_append_char(&sb, '/', ctx))
-        return make_json_error(JSON_ERR_OOM);
-      break; 
-    case STR_CONTROL_B:
-      if (!sb_append_char(&sb, '\b', ctx))
-        return make_json_error(JSON_ERR_OOM);
-      break; 
-    case STR_CONTROL_F:
-      if (!sb_append_char(&sb, '\f', ctx))
-        return make_json_error(JSON_ERR_OOM);
-      break; 
-    case STR_CONTROL_N:
-      if (!sb_append_char(&sb, '\n', ctx))
-        return make_json_error(JSON_ERR_OOM);
-      break; 
-    case STR_CONTROL_R:
-      if (!sb_append_char(&sb, '\r', ctx))
-        return make_json_error(JSON_ERR_OOM);
-      break; 
-    case STR_CONTROL_T:
-      if (!sb_append_char(&sb, '\t', ctx))
-        return make_json_error(JSON_ERR_OOM);
-      break; 
-
-    case ERR_INVALID_ESCAPE_CHAR:
-      return make_json_error(JSON_ERR_INVALID_ESCAPE_CHAR);
-
-    case STR_CONTROL_U: break;
-    case STR_UNICODE_HEX1:
-      ub_append_hex(&ub, c);
-      break; 
-    case STR_UNICODE_HEX2:
-      ub_append_hex(&ub, c);
-      break; 
-    case STR_UNICODE_HEX3:
-      ub_append_hex(&ub, c);
-      break; 
-    case STR_UNICODE_HEX4:
-      ub_append_hex(&ub, c);
-      sb_append_utf8(&sb, ub_toutf8(ub), ctx);
-      break; 
-    case STR_UNICODE_MAYBE_HS_HEX1:
-      ub_append_hex(&ub, c);
-      break; 
-    case STR_UNICODE_HS_HEX2:
-      ub_append_hex(&ub, c);
-      break; 
-    case STR_UNICODE_HS_HEX3:
-      ub_append_hex(&ub, c);
-      break; 
-    case STR_UNICODE_HS_HEX4:
-      ub_append_hex(&ub, c);
-      break; 
-    case STR_UNICODE_LS_CONTROL_SLASH: break;
-    case STR_UNICODE_LS_CONTROL_U: break;
-    case STR_UNICODE_LS_HEX1:
-      ub_append_lshex(&ub, c);
-      break; 
-    case STR_UNICODE_LS_HEX2:
-      ub_append_lshex(&ub, c);
-      break; 
-    case STR_UNICODE_LS_HEX3:
-      ub_append_lshex(&ub, c);
-      break; 
-    case STR_UNICODE_LS_HEX4:
-      ub_append_lshex(&ub, c);
-      sb_append_utf8(&sb, ub_toutf8(ub), ctx);
-      break; 
-
-    case ERR_INVALID_UNICODE_ESCAPE:
-      return make_json_error(JSON_ERR_INVALID_UNICODE_ESCAPE);
-    case ERR_LONE_SURROGATE:
-      return make_json_error(JSON_ERR_LONE_SURROGATE);
-    case ERR_UNPAIRED_SURROGATE:
-      return make_json_error(JSON_ERR_UNPAIRED_SURROGATE);
-
-    case STR_QUOTE_END:
-      return make_json_string(sb_tostr(&sb));
-
-    case NUM_MINUS:
-      nb = nb_negative(nb);
-      break; 
-    case NUM_ZERO:
-      nb = nb_append_int(nb, c);
-      break; 
-    case NUM_DIGIT19:
-      nb = nb_append_int(nb, c);
-      break; 
-    case NUM_DIGIT:
-      nb = nb_append_int(nb, c);
-      break; 
-
-    case NUM_DECIMAL: break;
-    case NUM_DECIMAL_DIGIT:
-      nb = nb_append_decimal(nb, c);
-      break; 
-
-    case NUM_EXPONENT: break;
-    case NUM_EXP_PLUS: break;
-    case NUM_EXP_MINUS:
-      nb = nb_negative_exp(nb);
-      break; 
-    case NUM_EXP_DIGIT:
-      nb = nb_append_exp(nb, c);
-      break; 
-
-    case ERR_LEADING_ZEROES:
-      return make_json_error(JSON_ERR_LEADING_ZEROES);
-    case ERR_PLUS_SIGN:
-      return make_json_error(JSON_ERR_PLUS_SIGN);
-    case ERR_NO_DIGIT_BEFORE_DECIMAL:
-      return make_json_error(JSON_ERR_NO_DIGIT_BEFORE_DECIMAL);
-    case ERR_NO_DIGIT_BEFORE_EXPONENT:
-      return make_json_error(JSON_ERR_NO_DIGIT_BEFORE_EXPONENT);
-    case ERR_NOT_A_NUMBER:
-      return make_json_error(JSON_ERR_NOT_A_NUMBER);
-    case ERR_DOUBLE_DECIMAL:
-      return make_json_error(JSON_ERR_DOUBLE_DECIMAL);
-    case ERR_DOUBLE_EXPONENT:
-      return make_json_error(JSON_ERR_DOUBLE_EXPONENT);
-    case NUM_END:
-      return make_json_number(nb_todouble(nb));
-    case JSON_BV_STATE_SIZE:
-      return make_json_error(JSON_ERR_CATCH_ALL);
-    }
-    next_byte(ctx);
+ append:
+  do {
+    if (!sb_append_char(&sb, c, ctx))
+      return make_json_error(JSON_ERR_OOM);
+    BV_ADVANCE();
+  } while (bv_action[state] == BV_APPEND);
+  BV_DISPATCH();
+
+ escape:
+  if (!sb_append_char(&sb, bv_escape[state], ctx))
+    return make_json_error(JSON_ERR_OOM);
+  BV_ADVANCE();
+  BV_DISPATCH();
+
+ hex:
+  ub_append_hex(&ub, c);
+  BV_ADVANCE();
+  BV_DISPATCH();
+
+ hex_end:
+  ub_append_hex(&ub, c);
+  sb_append_utf8(&sb, ub_toutf8(ub), ctx);
+  BV_ADVANCE();
+  BV_DISPATCH();
+
+ lshex:
+  ub_append_lshex(&ub, c);
+  BV_ADVANCE();
+  BV_DISPATCH();
+
+ lshex_end:
+  ub_append_lshex(&ub, c);
+  sb_append_utf8(&sb, ub_toutf8(ub), ctx);
+  BV_ADVANCE();
+  BV_DISPATCH();
+
+ minus:
+  nb = nb_negative(nb);
+  BV_ADVANCE();
+  BV_DISPATCH();
+
+ integer:
+  do {
+    nb = nb_append_int(nb, c);
+    BV_ADVANCE();
+  } while (bv_action[state] == BV_INT);
+  BV_DISPATCH();
+
+ decimal:
+  do {
+    nb = nb_append_decimal(nb, c);
+    BV_ADVANCE();
+  } while (bv_action[state] == BV_DECIMAL);
+  BV_DISPATCH();
+
+ exp_minus:
+  nb = nb_negative_exp(nb);
+  BV_ADVANCE();
+  BV_DISPATCH();
+
+ exp:
+  do {
+    nb = nb_append_exp(nb, c);
+    BV_ADVANCE();
+  } while (bv_action[state] == BV_EXP);
+  BV_DISPATCH();
+
+ null:
+  return make_json_null();
+ true_:
+  return make_json_bool(true);
+ false_:
+  return make_json_bool(false);
+ string:
+  return make_json_string(sb_tostr(&sb, ctx));
+ number:
+  return make_json_number(nb_todouble(nb));
+
+#ifndef __GNUC__
+ dispatch_switch:
+  switch ((enum json_bv_action)bv_action[state]) {
+  case BV_SKIP: goto skip;
+  case BV_APPEND: goto append;
+  case BV_ESCAPE: goto escape;
+  case BV_HEX: goto hex;
+  case BV_HEX_END: goto hex_end;
+  case BV_LSHEX: goto lshex;
+  case BV_LSHEX_END: goto lshex_end;
+  case BV_MINUS: goto minus;
+  case BV_INT: goto integer;
+  case BV_DECIMAL: goto decimal;
+  case BV_EXP_MINUS: goto exp_minus;
+  case BV_EXP: goto exp;
+  case BV_NULL: goto null;
+  case BV_TRUE: goto true_;
+  case BV_FALSE: goto false_;
+  case BV_STRING: goto string;
+  case BV_NUMBER: goto number;
+  case BV_ERROR: case BV_ACTION_SIZE: goto fail;
   }
-  //  printf("\n");
+#endif
+
+ end:
   // To handle the case where the json string is just a number since numbers don't have a fixed ending character
   if (nb.has_num) return make_json_number(nb_todouble(nb));
   else return make_json_error(JSON_ERR_INVALID_END);
+
+ fail:
+  return make_json_error(bv_error[state]);
 }
 
+#undef BV_STATS_CLASS
+#undef BV_ADVANCE
+#undef BV_DISPATCH
+
 static bool
 ustreq(const ustring a, const ustring b)
 {
@@ -1055,59 +1577,261 @@ Json_Parser *
 make_parser(struct json_source src, struct json_allocator al)
 {
   struct json_parser *p = al.al_malloc(sizeof(struct json_parser), al.ctx);
+  if (p == NULL) return NULL;
   p->allocator = al;
+  p->offset = 0;
+  p->line_start = 0;
   p->line_num = 0;
-  p->char_num = 0;
+#ifdef JP_STATS
+  p->stats = (struct json_stats){0};
+#endif
   p->max_depth = -1;
+  p->flags = 0;
+  p->arena_high_water = -1;
+  p->sizes.arr = NULL;
+  p->sizes.len = 0;
+  p->sizes.cap = 0;
+  p->sizes.next = 0;
+  p->open.arr = NULL;
+  p->open.len = 0;
+  p->open.cap = 0;
+  p->scratch.vals = NULL;
+  p->scratch.len = 0;
+  p->scratch.cap = 0;
+  p->scratch.keys = NULL;
+  p->scratch.keys_len = 0;
+  p->scratch.keys_cap = 0;
+  p->stack.arr = NULL;
+  p->stack.len = 0;
+  p->stack.cap = 0;
+  memset(p->learned, 0, sizeof(p->learned));
+  p->proj.arr = NULL;
+  p->proj.len = 0;
+  p->proj.cap = 0;
+  p->proj.bytes = NULL;
 
   p->source = src;
-  p->pool.arenas = NULL;
-  p->pool.len = 0;
-  p->pool.cap = 0;
-  Arena a = {0};
-  a.beg = al.al_malloc(INIT_ARENA_SIZE, al.ctx);
-  a.end = a.beg + INIT_ARENA_SIZE;
-  arena_push_back(p, a);
+  p->pool.head = NULL;
+  p->pool.cur = NULL;
+  p->pool.big = NULL;
+  p->pool.last = NULL;
+  p->pool.next_size = INIT_ARENA_SIZE;
+  p->pool.reserved = 0;
+  p->pool.peak = 0;
+  p->pool.abandoned = 0;
+  p->pool.head = arena_new_block(p, p->pool.next_size);
+  if (p->pool.head == NULL) {
+    al.al_free(p, al.ctx);
+    return NULL;
+  }
+  p->pool.cur = p->pool.head;
+  p->pool.next_size *= 2;
 
   return p;
 }
 void json_parser_set_streaming(Json_Parser *p, bool streaming)
 {
-  if(streaming) p->flags = p->flags | 1;
+  if(streaming) p->flags = p->flags | JP_FLAG_STREAMING;
+}
+void json_parser_set_exact_size(Json_Parser *p, bool exact)
+{
+  if (exact) p->flags = p->flags | JP_FLAG_EXACT_SIZE;
+  else p->flags = p->flags & ~JP_FLAG_EXACT_SIZE;
+}
+void json_parser_set_scratch_build(Json_Parser *p, bool scratch)
+{
+  if (scratch) p->flags = p->flags | JP_FLAG_SCRATCH;
+  else p->flags = p->flags & ~JP_FLAG_SCRATCH;
+}
+void json_parser_set_adaptive_size(Json_Parser *p, bool adaptive)
+{
+  if (adaptive) p->flags = p->flags | JP_FLAG_ADAPTIVE;
+  else p->flags = p->flags & ~JP_FLAG_ADAPTIVE;
+}
+// Child of node n named key, a new one when there is none yet.
+static ptrdiff_t
+proj_child(struct json_parser ctx[static 1], ptrdiff_t n, ustring key)
+{
+  for (ptrdiff_t c = ctx->proj.arr[n].child; c >= 0; c = ctx->proj.arr[c].sibling) {
+    if (ustreq(ctx->proj.arr[c].key, key)) return c;
+  }
+  if (ctx->proj.len >= ctx->proj.cap) {
+    struct json_proj *tmp = al_grow(ctx, ctx->proj.arr, &ctx->proj.cap, sizeof(struct json_proj));
+    if (tmp == NULL) return -1;
+    ctx->proj.arr = tmp;
+  }
+  ptrdiff_t c = ctx->proj.len++;
+  ctx->proj.arr[c] = (struct json_proj){ .key = key, .child = -1, .sibling = ctx->proj.arr[n].child };
+  ctx->proj.arr[n].child = c;
+  return c;
+}
+
+bool json_parser_set_projection(Json_Parser *p, const char *const *paths, ptrdiff_t len)
+{
+  p->allocator.al_free(p->proj.arr, p->allocator.ctx);
+  p->allocator.al_free(p->proj.bytes, p->allocator.ctx);
+  p->proj.arr = NULL;
+  p->proj.len = 0;
+  p->proj.cap = 0;
+  p->proj.bytes = NULL;
+  if (len <= 0) return true;
+
+  ptrdiff_t total = 0;
+  for (ptrdiff_t i = 0; i < len; ++i) {
+    if (paths[i][0] != '\0' && paths[i][0] != '/') return false;
+    total += strlen(paths[i]);
+  }
+  p->proj.bytes = p->allocator.al_malloc(total + 1, p->allocator.ctx);
+  if (p->proj.bytes == NULL) return false;
+  unsigned char *bytes = p->proj.bytes;
+  p->proj.arr = al_grow(p, NULL, &p->proj.cap, sizeof(struct json_proj));
+  if (p->proj.arr == NULL) goto fail;
+  p->proj.arr[0] = (struct json_proj){ .child = -1, .sibling = -1 };
+  p->proj.len = 1;
+  for (ptrdiff_t i = 0; i < len; ++i) {
+    ptrdiff_t n = 0;
+    const char *path = paths[i];
+    while (*path == '/') {
+      ustring key = { .s = bytes, .len = 0 };
+      for (++path; *path != '\0' && *path != '/'; ++path) key.s[key.len++] = (unsigned char)*path;
+      bytes += key.len;
+      n = proj_child(p, n, key);
+      if (n < 0) goto fail;
+    }
+    p->proj.arr[n].keep = true;
+  }
+  return true;
+
+ fail:
+  json_parser_set_projection(p, NULL, 0);
+  return false;
 }
 void json_parser_set_max_depth(Json_Parser *p, int max_depth)
 {
   p->max_depth = max_depth;
 }
-int json_parser_linenum(Json_Parser *p)
+int json_parser_linenum(const Json_Parser *p)
 {
   return p->line_num;
 }
-int json_parser_position(Json_Parser *p)
+int json_parser_position(const Json_Parser *p)
+{
+  return (int)(p->offset - p->line_start);
+}
+void json_block_cache_set_cap(ptrdiff_t cap)
+{
+  block_cache.cap = cap > 0 ? cap : 0;
+#ifndef __STDC_NO_THREADS__
+  if (block_cache.cap > 0) {
+    call_once(&block_cache_once, block_cache_key_create);
+    if (block_cache_key_ok) tss_set(block_cache_key, &block_cache);
+  }
+#endif
+  while (block_cache.bytes > block_cache.cap) {
+    Arena *a = block_cache.head;
+    struct json_allocator al;
+    memcpy(&al, a->beg, sizeof(al));
+    block_cache.head = a->next;
+    block_cache.bytes -= a->end - a->beg;
+    al.al_free(a, al.ctx);
+  }
+}
+void json_block_cache_flush(void)
+{
+  ptrdiff_t cap = block_cache.cap;
+  json_block_cache_set_cap(0);
+  block_cache.cap = cap;
+}
+struct json_memory json_parser_memory(const Json_Parser *p)
 {
-  return p->char_num;
+  // a handful of blocks at most, they double up to MAX_ARENA_SIZE
+  ptrdiff_t handed_out = 0;
+  for (const Arena *a = p->pool.head; a; a = a->next) handed_out += a->cur - a->beg;
+  for (const Arena *a = p->pool.big; a; a = a->next) handed_out += a->cur - a->beg;
+  return (struct json_memory){
+    .reserved = p->pool.reserved,
+    .used = handed_out - p->pool.abandoned,
+    .abandoned = p->pool.abandoned,
+    .peak = p->pool.peak,
+  };
+}
+bool json_parser_stats(const Json_Parser *p, struct json_stats *out)
+{
+#ifdef JP_STATS
+  *out = p->stats;
+  out->bytes = p->offset;
+  return true;
+#else
+  (void)p;
+  *out = (struct json_stats){0};
+  return false;
+#endif
+}
+void json_parser_set_arena_high_water(Json_Parser *p, ptrdiff_t bytes)
+{
+  p->arena_high_water = bytes;
 }
 void json_parser_reset(Json_Parser *p)
 {
+  p->offset = 0;
+  p->line_start = 0;
   p->line_num = 0;
-  p->char_num = 0;
-  for (ptrdiff_t i = 0; i < p->pool.len; ++i)
-    p->allocator.al_free(p->pool.arenas[i].beg, p->allocator.ctx);
-
-  p->allocator.al_free(p->pool.arenas, p->allocator.ctx);
-  p->pool.arenas = NULL;
-  p->pool.len = 0;
-  p->pool.cap = 0;
+#ifdef JP_STATS
+  p->stats = (struct json_stats){0};
+#endif
+  p->json_node = make_json_null();
+
+  // Keep the blocks and rewind them so the next parse doesn't go back to the
+  // allocator. Only the blocks past the high water mark are released.
+  arena_free_list(p, p->pool.big);
+  p->pool.big = NULL;
+  p->pool.last = NULL;
+  p->pool.abandoned = 0;
+  ptrdiff_t retained = 0;
+  Arena **link = &p->pool.head;
+  while (*link) {
+    Arena *a = *link;
+    ptrdiff_t sz = a->end - a->beg;
+    if (p->arena_high_water >= 0 && retained + sz > p->arena_high_water) {
+      *link = NULL;
+      arena_free_list(p, a);
+      break;
+    }
+    a->cur = a->beg;
+    retained += sz;
+    link = &a->next;
+  }
+  p->pool.cur = p->pool.head;
+  // Grow from the blocks that were kept like a fresh parser would, otherwise
+  // every overflow after a few resets would ask for the largest block.
+  ptrdiff_t last = p->pool.head ? INIT_ARENA_SIZE : INIT_ARENA_SIZE/2;
+  for (Arena *a = p->pool.head; a; a = a->next) {
+    if (a->end - a->beg > last) last = a->end - a->beg;
+  }
+  p->pool.next_size = 2*last < MAX_ARENA_SIZE ? 2*last : MAX_ARENA_SIZE;
 }
 const Json_View * json_parse(Json_Parser *p)
 {
-  p->json_node = parse_json_value(p);
+  p->sizes.len = 0;
+  p->sizes.next = 0;
+  p->scratch.len = 0;
+  p->scratch.keys_len = 0;
+  if ((p->flags & JP_FLAG_EXACT_SIZE) && (p->flags & JP_FLAG_STREAMING) == 0
+      && p->source.rewind != NULL && !count_containers(p)) {
+    p->json_node = make_json_error(JSON_ERR_OOM);
+    return &p->json_node;
+  }
+  p->json_node = parse_json_value(p, p->proj.len && !p->proj.arr[0].keep ? 0 : PROJ_ALL);
+  if (p->json_node.type == JSON_ERROR) {
+    // keep the position and code of the first error
+    return &p->json_node;
+  }
   if (p->json_node.type != JSON_NUMBER) {
     next_byte(p);
   }
 
   // check if the entire json source has been consumed if not streaming
-  if ((p->flags & 1) == 0) {
+  if ((p->flags & JP_FLAG_STREAMING) == 0) {
     skip_whitespace(p);
     if (has_next_byte(p)) {
       p->json_node = make_json_error(JSON_ERR_INVALID_END);
@@ -1120,10 +1844,15 @@ const Json_View * json_parse(Json_Parser *p)
 void
 destroy_parser(Json_Parser *p)
 {
-  for (ptrdiff_t i = 0; i < p->pool.len; ++i)
-    p->allocator.al_free(p->pool.arenas[i].beg, p->allocator.ctx);
-
-  p->allocator.al_free(p->pool.arenas, p->allocator.ctx);
+  arena_free_list(p, p->pool.head);
+  arena_free_list(p, p->pool.big);
+  p->allocator.al_free(p->sizes.arr, p->allocator.ctx);
+  p->allocator.al_free(p->open.arr, p->allocator.ctx);
+  p->allocator.al_free(p->scratch.keys, p->allocator.ctx);
+  p->allocator.al_free(p->scratch.vals, p->allocator.ctx);
+  p->allocator.al_free(p->stack.arr, p->allocator.ctx);
+  p->allocator.al_free(p->proj.arr, p->allocator.ctx);
+  p->allocator.al_free(p->proj.bytes, p->allocator.ctx);
   p->allocator.al_free(p, p->allocator.ctx);
 }
 
@@ -1176,389 +1905,3176 @@ const char * json_error(const Json_View *v)
   return err_lookup_table[v->value.err_code];
 }
 
-#ifdef TEST
-
-#include <dirent.h>
-#include <sys/stat.h>
-#include <errno.h>
-#include <string.h>
-#include <stdio.h>
-
-struct json_string_source_ctx {
-  unsigned char *json_string;
-  ptrdiff_t len;
-  ptrdiff_t cursor;
-};
-
-static void
-str_next_byte(void *ctx)
+static Json_View *
+new_node(Json_Parser *p, struct json_ast_node node)
 {
-  struct json_string_source_ctx *ss = ctx;
-  ++ss->cursor;
+  struct json_ast_node *v = parser_malloc(p, sizeof(struct json_ast_node));
+  if (v) *v = node;
+  return v;
 }
 
-static unsigned char
-str_get_byte(void *ctx)
+static ustring
+copy_ustring(Json_Parser *p, ustring s)
 {
-  struct json_string_source_ctx *ss = ctx;
-  return ss->json_string[ss->cursor];
+  unsigned char *str = parser_malloc(p, s.len + 1);
+  if (str == NULL) return (ustring){0};
+  memcpy(str, s.s, s.len);
+  str[s.len] = '\0';
+  return (ustring){ .s = str, .len = s.len };
 }
 
-static bool
-str_has_next_byte(void *ctx)
+Json_View * json_parser_root(Json_Parser *p)
 {
-  struct json_string_source_ctx *ss = ctx;
-  return (ss->cursor < ss->len);
+  return &p->json_node;
+}
+Json_View * json_mut(const Json_View *v)
+{
+  return (Json_View *)v;
+}
+Json_View * json_new_null(Json_Parser *p)
+{
+  return new_node(p, make_json_null());
+}
+Json_View * json_new_bool(Json_Parser *p, bool b)
+{
+  return new_node(p, make_json_bool(b));
+}
+Json_View * json_new_number(Json_Parser *p, double num)
+{
+  return new_node(p, make_json_number(num));
+}
+Json_View * json_new_string(Json_Parser *p, ustring s)
+{
+  ustring str = copy_ustring(p, s);
+  if (str.s == NULL) return NULL;
+  return new_node(p, make_json_string(str));
+}
+Json_View * json_new_array(Json_Parser *p)
+{
+  return new_node(p, make_json_empty_array());
+}
+Json_View * json_new_object(Json_Parser *p)
+{
+  return new_node(p, make_json_empty_object());
+}
+Json_View * json_array_push(Json_Parser *p, Json_View *arr, const Json_View *val)
+{
+  assert(arr->type == JSON_ARRAY);
+  if (!json_vec_append(&(arr->value.vec), *val, p)) return NULL;
+  return arr->value.vec.arr + arr->value.vec.len - 1;
+}
+Json_View * json_object_set(Json_Parser *p, Json_View *obj, ustring key, const Json_View *val)
+{
+  assert(obj->type == JSON_OBJECT);
+  for (ptrdiff_t i = 0; i < obj->value.obj.len; ++i) {
+    if (ustreq(key, obj->value.obj.keys[i])) {
+      obj->value.obj.vals[i] = *val;
+      return obj->value.obj.vals + i;
+    }
+  }
+  ustring k = copy_ustring(p, key);
+  if (k.s == NULL || !json_obj_append(&(obj->value.obj), k, *val, p)) return NULL;
+  return obj->value.obj.vals + obj->value.obj.len - 1;
+}
+void json_replace(Json_View *dst, const Json_View *src)
+{
+  *dst = *src;
 }
 
-struct json_string_source_ctx make_ss(unsigned char *str, ptrdiff_t len) {
-  return (struct json_string_source_ctx){.json_string = str, .len = len, .cursor = 0};
+// Lays a copy of a subtree out in preorder: each container's element arrays
+// come right after the container, then every child in turn with its key.
+// Running it with base NULL only measures, so the copy can be made into a
+// block of exactly that size with the same walk. al holds the stack of open
+// containers once it outgrows the C stack.
+struct json_layout {
+  char *base;
+  ptrdiff_t off;
+  struct json_allocator al;
+};
+
+// A container layout_node is copying the children of, dst is NULL when
+// measuring.
+struct layout_frame {
+  const struct json_ast_node *src;
+  struct json_ast_node *dst;
+  ptrdiff_t next;
+};
+
+#define LAYOUT_STACK 256
+
+static void *
+layout_place(struct json_layout *l, ptrdiff_t sz, ptrdiff_t align)
+{
+  l->off += (align - l->off % align) % align;
+  void *mem = l->base ? l->base + l->off : NULL;
+  l->off += sz;
+  return mem;
 }
 
-struct json_source string_source_make(struct json_string_source_ctx *ctx) {
-  return (struct json_source){ .next = str_next_byte, .get_byte = str_get_byte, .has_next = str_has_next_byte, .ctx = ctx};
+static ustring
+layout_string(struct json_layout *l, ustring s)
+{
+  unsigned char *str = layout_place(l, s.len + 1, 1);
+  if (str == NULL) return (ustring){0};
+  if (s.len > 0) memcpy(str, s.s, s.len);
+  str[s.len] = '\0';
+  return (ustring){ .s = str, .len = s.len };
 }
 
-static void
-print_json_node_helper(const struct json_parser *p, const struct json_ast_node node, int level)
+// Walks without recursing so any document the parser accepts can be copied.
+// Fails only when the stack can't grow.
+static bool
+layout_node(struct json_layout *l, const struct json_ast_node *src, struct json_ast_node *dst)
 {
-  switch (node.type) {
-  case JSON_NULL:
-    printf("null");
-    break;
-  case JSON_BOOL:
-    printf("%s", (node.value.b ? "true" : "false"));
+  struct layout_frame local[LAYOUT_STACK];
+  struct layout_frame *stack = local;
+  ptrdiff_t len = 0;
+  ptrdiff_t cap = LAYOUT_STACK;
+  bool ok = false;
+
+ node:
+  if (dst) *dst = *src;
+  switch (src->type) {
+  case JSON_STRING: {
+    ustring s = layout_string(l, src->value.s);
+    if (dst) dst->value.s = s;
     break;
-  case JSON_ARRAY:
-    printf("[\n");
-    for (int i = 0; i < level; ++i) printf("\t");
-    if (node.value.vec.len) {
-      print_json_node_helper(p, node.value.vec.arr[0], level+1);
+  }
+  case JSON_ARRAY: {
+    ptrdiff_t n = src->value.vec.len;
+    if (n == 0) {
+      if (dst) dst->value.vec = (struct json_arr){0};
+      break;
     }
-
-    for (ptrdiff_t i = 1; i < node.value.vec.len; ++i) {
-      printf(",\n");
-      for (int i = 0; i < level; ++i) printf("\t");
-      print_json_node_helper(p, node.value.vec.arr[i], level+1);
+    struct json_ast_node *arr = layout_place(l, n*sizeof(*arr), alignof(struct json_ast_node));
+    if (dst) {
+      dst->value.vec.arr = arr;
+      dst->value.vec.cap = n;
     }
-    printf("\n");
-    for (int i = 0; i < level-1; ++i) printf("\t");
-    printf("]");
-    break;
-  case JSON_OBJECT:
-    printf("{\n");
-    for (int i = 0; i < level; ++i) printf("\t");
-    if (node.value.obj.len) {
-      printf("\"%s\"", (char *)node.value.obj.keys[0].s);
-      printf(" : ");
-      print_json_node_helper(p, node.value.obj.vals[0], level+1);
+    goto push;
+  }
+  case JSON_OBJECT: {
+    ptrdiff_t n = src->value.obj.len;
+    if (n == 0) {
+      if (dst) dst->value.obj = (struct json_fields){0};
+      break;
     }
-
-    for(ptrdiff_t i = 1; i < node.value.obj.len; ++i) {
-      printf(",\n");
-      for (int i = 0; i < level; ++i) printf("\t");
-      printf("\"%s\"", (char *)node.value.obj.keys[i].s);
-      printf(" : ");
-      print_json_node_helper(p, node.value.obj.vals[i], level+1);
+    ustring *keys = layout_place(l, n*sizeof(*keys), alignof(ustring));
+    struct json_ast_node *vals = layout_place(l, n*sizeof(*vals), alignof(struct json_ast_node));
+    if (dst) {
+      dst->value.obj.keys = keys;
+      dst->value.obj.vals = vals;
+      dst->value.obj.cap = n;
     }
-    printf("\n");
-    for (int i = 0; i < level-1; ++i) printf("\t");
-    printf("}");
-    break;
-  case JSON_NUMBER:
-    printf("%lf", node.value.num);
-    break;
-  case JSON_STRING:
-    printf("\"%s\"", (char *)node.value.s.s);
-    break;
-  case JSON_ERROR:
-    printf("At line number: %d, char number %d %s", p->line_num, p->char_num, err_lookup_table[node.value.err_code]);
+    goto push;
+  }
+  default:
     break;
   }
+
+ next:
+  while (len > 0) {
+    struct layout_frame *f = &stack[len - 1];
+    if (f->src->type == JSON_ARRAY) {
+      if (f->next == f->src->value.vec.len) {
+        --len;
+        continue;
+      }
+      ptrdiff_t i = f->next++;
+      src = f->src->value.vec.arr + i;
+      dst = f->dst ? f->dst->value.vec.arr + i : NULL;
+    } else {
+      if (f->next == f->src->value.obj.len) {
+        --len;
+        continue;
+      }
+      ptrdiff_t i = f->next++;
+      ustring key = layout_string(l, f->src->value.obj.keys[i]);
+      if (f->dst) f->dst->value.obj.keys[i] = key;
+      src = f->src->value.obj.vals + i;
+      dst = f->dst ? f->dst->value.obj.vals + i : NULL;
+    }
+    goto node;
+  }
+  ok = true;
+  goto done;
+
+ push:
+  if (len == cap) {
+    struct layout_frame *tmp = l->al.al_malloc(2*cap*sizeof(*tmp), l->al.ctx);
+    if (tmp == NULL) goto done;
+    memcpy(tmp, stack, len*sizeof(*tmp));
+    if (stack != local) l->al.al_free(stack, l->al.ctx);
+    stack = tmp;
+    cap *= 2;
+  }
+  stack[len++] = (struct layout_frame){ .src = src, .dst = dst, .next = 0 };
+  goto next;
+
+ done:
+  if (stack != local) l->al.al_free(stack, l->al.ctx);
+  return ok;
 }
 
-static void
-print_json_node(const struct json_parser *p, const struct json_ast_node node)
+// The allocator sits in front of the cloned root so json_clone_free can find it.
+const Json_View * json_clone(const Json_View *v, struct json_allocator al)
 {
-  print_json_node_helper(p, node, 1);
+  if (v == NULL) return NULL;
+  ptrdiff_t hdr = align_size(sizeof(struct json_allocator));
+  struct json_layout l = { .base = NULL, .off = hdr + sizeof(struct json_ast_node), .al = al };
+  if (!layout_node(&l, v, NULL)) return NULL;
+  char *mem = al.al_malloc(l.off, al.ctx);
+  if (mem == NULL) return NULL;
+  memcpy(mem, &al, sizeof(al));
+  struct json_ast_node *root = (struct json_ast_node *)(mem + hdr);
+  l = (struct json_layout){ .base = mem, .off = hdr + sizeof(*root), .al = al };
+  if (!layout_node(&l, v, root)) {
+    al.al_free(mem, al.ctx);
+    return NULL;
+  }
+  return root;
 }
-
-static char *
-read_file_to_string(const char *path, size_t *out_len)
+void json_clone_free(const Json_View *v)
 {
-    FILE *fp = fopen(path, "rb");
-    if (!fp) {
-        perror("fopen");
-        return NULL;
-    }
+  if (v == NULL) return;
+  char *mem = (char *)v - align_size(sizeof(struct json_allocator));
+  struct json_allocator al;
+  memcpy(&al, mem, sizeof(al));
+  al.al_free(mem, al.ctx);
+}
 
-    if (fseek(fp, 0, SEEK_END) != 0) {
-        perror("fseek");
-        fclose(fp);
-        return NULL;
-    }
+// The compacted block becomes the parser's only arena block, full, so a reset
+// rewinds it for the next parse like any other block.
+bool json_parser_compact(Json_Parser *p)
+{
+  struct json_layout l = { .al = p->allocator };
+  if (!layout_node(&l, &p->json_node, NULL)) return false;
+  ptrdiff_t hdr = align_size(sizeof(Arena));
+  Arena *a = p->allocator.al_malloc(hdr + l.off, p->allocator.ctx);
+  if (a == NULL) return false;
+  a->next = NULL;
+  a->beg = (char *)a + hdr;
+  a->end = a->beg + l.off;
+  a->cur = a->end;
+  struct json_ast_node root;
+  l = (struct json_layout){ .base = a->beg, .al = p->allocator };
+  if (!layout_node(&l, &p->json_node, &root)) {
+    p->allocator.al_free(a, p->allocator.ctx);
+    return false;
+  }
+  p->json_node = root;
+
+  arena_free_list(p, p->pool.head);
+  arena_free_list(p, p->pool.big);
+  p->pool.head = a;
+  p->pool.cur = a;
+  p->pool.big = NULL;
+  p->pool.last = NULL;
+  p->pool.abandoned = 0;
+  p->pool.reserved += l.off;
+  if (p->pool.reserved > p->pool.peak) p->pool.peak = p->pool.reserved;
+  return true;
+}
 
-    long len = ftell(fp);
-    if (len < 0) {
-        perror("ftell");
-        fclose(fp);
-        return NULL;
-    }
+#define JSON_DECODE_MAX_FIELDS 64
 
-    rewind(fp);
+static bool
+field_name_eq(const char *name, ustring key)
+{
+  for (ptrdiff_t i = 0; i < key.len; ++i) {
+    if (name[i] == '\0' || (unsigned char)name[i] != key.s[i]) return false;
+  }
+  return name[key.len] == '\0';
+}
 
-    char *buffer = malloc(len + 1);
-    if (!buffer) {
-        perror("malloc");
-        fclose(fp);
-        return NULL;
-    }
+static ptrdiff_t
+find_field(const struct json_struct_desc *d, ustring key, ptrdiff_t expect)
+{
+  // fields usually arrive in declaration order, try the next one first
+  if (expect < d->len && field_name_eq(d->fields[expect].name, key)) return expect;
+  if (d->match) return d->match(key.s, key.len);
+  for (ptrdiff_t i = 0; i < d->len; ++i) {
+    if (field_name_eq(d->fields[i].name, key)) return i;
+  }
+  return -1;
+}
 
-    if (fread(buffer, 1, len, fp) != (size_t)len) {
-        perror("fread");
-        free(buffer);
-        fclose(fp);
-        return NULL;
-    }
+static bool
+decode_fail(struct json_parser ctx[static 1], enum json_err err)
+{
+  ctx->json_node = make_json_error(err);
+  return false;
+}
 
-    buffer[len] = '\0';
-    fclose(fp);
+static bool decode_object(struct json_parser ctx[static 1], const struct json_struct_desc *d, char *out);
 
-    if (out_len) *out_len = (size_t)len;
-    return buffer;
+static bool
+is_digit_byte(struct json_parser ctx[static 1])
+{
+  return has_next_byte(ctx) && get_byte(ctx) >= '0' && get_byte(ctx) <= '9';
 }
 
+// Reads an integer straight from the source, the double parse_base_value
+// makes can't hold every int64_t. Fractions, exponents and values out of
+// range don't match. Leaves the cursor on the byte after the number.
+static bool
+decode_int(struct json_parser ctx[static 1], int64_t *out)
+{
+  bool neg = get_byte(ctx) == '-';
+  if (neg) next_byte(ctx);
+  if (!is_digit_byte(ctx)) return decode_fail(ctx, JSON_ERR_NOT_A_NUMBER);
+  uint64_t limit = neg ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+  uint64_t n = 0;
+  if (get_byte(ctx) == '0') {
+    next_byte(ctx);
+    if (is_digit_byte(ctx)) return decode_fail(ctx, JSON_ERR_LEADING_ZEROES);
+  }
+  while (is_digit_byte(ctx)) {
+    unsigned d = get_byte(ctx) - '0';
+    if (n > (limit - d)/10) return decode_fail(ctx, JSON_ERR_TYPE_MISMATCH);
+    n = 10*n + d;
+    next_byte(ctx);
+  }
+  if (has_next_byte(ctx)) {
+    unsigned char c = get_byte(ctx);
+    if (c == '.' || c == 'e' || c == 'E') return decode_fail(ctx, JSON_ERR_TYPE_MISMATCH);
+  }
+  if (!neg) *out = (int64_t)n;
+  else if (n == limit) *out = INT64_MIN;
+  else *out = -(int64_t)n;
+  return true;
+}
+
+// Decodes the value under the cursor into dst and leaves the cursor on the
+// byte after it.
+static bool
+decode_field(struct json_parser ctx[static 1], const struct json_field *f, char *dst)
+{
+  unsigned char c = get_byte(ctx);
+  struct json_ast_node node;
+  switch (f->type) {
+  case JSON_FIELD_BOOL:
+    if (c != 't' && c != 'f') return decode_fail(ctx, JSON_ERR_TYPE_MISMATCH);
+    node = parse_base_value(ctx);
+    if (node.type == JSON_ERROR) return decode_fail(ctx, node.value.err_code);
+    memcpy(dst, &node.value.b, sizeof(bool));
+    next_byte(ctx);
+    return true;
+  case JSON_FIELD_INT: {
+    if (c != '-' && !(c >= '0' && c <= '9')) return decode_fail(ctx, JSON_ERR_TYPE_MISMATCH);
+    int64_t i;
+    if (!decode_int(ctx, &i)) return false;
+    memcpy(dst, &i, sizeof(int64_t));
+    return true;
+  }
+  case JSON_FIELD_DOUBLE:
+    if (c != '-' && !(c >= '0' && c <= '9')) return decode_fail(ctx, JSON_ERR_TYPE_MISMATCH);
+    node = parse_base_value(ctx);
+    if (node.type == JSON_ERROR) return decode_fail(ctx, node.value.err_code);
+    memcpy(dst, &node.value.num, sizeof(double));
+    return true;
+  case JSON_FIELD_STRING:
+    if (c != '"') return decode_fail(ctx, JSON_ERR_TYPE_MISMATCH);
+    node = parse_base_value(ctx);
+    if (node.type == JSON_ERROR) return decode_fail(ctx, node.value.err_code);
+    memcpy(dst, &node.value.s, sizeof(ustring));
+    next_byte(ctx);
+    return true;
+  case JSON_FIELD_OBJECT:
+    if (c != '{') return decode_fail(ctx, JSON_ERR_TYPE_MISMATCH);
+    return decode_object(ctx, f->desc, dst);
+  case JSON_FIELD_VIEW: {
+    node = parse_json_value(ctx, PROJ_ALL);
+    if (node.type == JSON_ERROR) return decode_fail(ctx, node.value.err_code);
+    const Json_View *v = new_node(ctx, node);
+    if (v == NULL) return decode_fail(ctx, JSON_ERR_OOM);
+    memcpy(dst, &v, sizeof(v));
+    if (node.type != JSON_NUMBER) next_byte(ctx);
+    return true;
+  }
+  }
+  return decode_fail(ctx, JSON_ERR_CATCH_ALL);
+}
+
+static bool
+decode_object(struct json_parser ctx[static 1], const struct json_struct_desc *d, char *out)
+{
+  if (d->len > JSON_DECODE_MAX_FIELDS) return decode_fail(ctx, JSON_ERR_TOO_MANY_FIELDS);
+  uint64_t seen = 0;
+  ptrdiff_t expect = 0;
+  next_byte(ctx);
+  skip_whitespace(ctx);
+  if (get_byte(ctx) == '}') goto done;
+  for (;;) {
+    if (!has_next_byte(ctx)) return decode_fail(ctx, JSON_ERR_INVALID_END);
+    if (get_byte(ctx) != '"') return decode_fail(ctx, JSON_ERR_KEY_NOT_STRING);
+    struct json_ast_node key = parse_base_value(ctx);
+    if (key.type == JSON_ERROR) return decode_fail(ctx, key.value.err_code);
+    ptrdiff_t i = find_field(d, key.value.s, expect);
+    // the key is not kept, hand its bytes back to the arena
+    parser_trim(ctx, key.value.s.s, 0);
+    next_byte(ctx);
+    skip_whitespace(ctx);
+    if (get_byte(ctx) != ':') return decode_fail(ctx, JSON_ERR_COLON_NOT_FOUND);
+    next_byte(ctx);
+    skip_whitespace(ctx);
+
+    if (i < 0) {
+      if (!skip_json_value(ctx, NULL)) return decode_fail(ctx, JSON_ERR_INVALID_END);
+    } else if (get_byte(ctx) == 'n') {
+      // null leaves the field as it was, like a missing one
+      struct json_ast_node null = parse_base_value(ctx);
+      if (null.type == JSON_ERROR) return decode_fail(ctx, null.value.err_code);
+      next_byte(ctx);
+    } else {
+      if (!decode_field(ctx, d->fields + i, out + d->fields[i].offset)) return false;
+      seen |= (uint64_t)1 << i;
+      expect = i + 1;
+    }
+
+    skip_whitespace(ctx);
+    if (get_byte(ctx) == ',') {
+      next_byte(ctx);
+      skip_whitespace(ctx);
+    } else if (get_byte(ctx) == '}') {
+      break;
+    } else {
+      return decode_fail(ctx, JSON_ERR_OBJ_TRAILING_COMMA);
+    }
+  }
+ done:
+  next_byte(ctx);
+  for (ptrdiff_t i = 0; i < d->len; ++i) {
+    if (d->fields[i].required && (seen & ((uint64_t)1 << i)) == 0)
+      return decode_fail(ctx, JSON_ERR_MISSING_FIELD);
+  }
+  return true;
+}
+
+bool json_decode(Json_Parser *p, const struct json_struct_desc *desc, void *out)
+{
+  p->scratch.len = 0;
+  p->scratch.keys_len = 0;
+  p->sizes.len = 0;
+  p->sizes.next = 0;
+  p->json_node = make_json_null();
+  // reject the description before reading anything
+  if (desc->len > JSON_DECODE_MAX_FIELDS) return decode_fail(p, JSON_ERR_TOO_MANY_FIELDS);
+  skip_whitespace(p);
+  if (!has_next_byte(p)) return decode_fail(p, JSON_ERR_INVALID_END);
+  if (get_byte(p) != '{') return decode_fail(p, JSON_ERR_TYPE_MISMATCH);
+  if (!decode_object(p, desc, out)) return false;
+  if ((p->flags & JP_FLAG_STREAMING) == 0) {
+    skip_whitespace(p);
+    if (has_next_byte(p)) return decode_fail(p, JSON_ERR_INVALID_END);
+  }
+  return true;
+}
+
+const char * json_parser_error(const Json_Parser *p)
+{
+  if (p->json_node.type != JSON_ERROR) return NULL;
+  return err_lookup_table[p->json_node.value.err_code];
+}
+
+// Output buffer shared by the serializers. grow makes room once the buffer is
+// full, by reallocating it or by flushing it to a sink. A buffer without grow
+// is fixed: whatever does not fit is dropped but still counted in total.
+struct json_out {
+  unsigned char *buf;
+  ptrdiff_t len;
+  ptrdiff_t cap;
+  ptrdiff_t total;
+  bool failed;
+  bool (*grow)(struct json_out *o, ptrdiff_t need);
+  void *ctx;
+};
+
+static void
+out_write(struct json_out *o, const void *src, ptrdiff_t n)
+{
+  const unsigned char *p = src;
+  o->total += n;
+  while (n > o->cap - o->len) {
+    ptrdiff_t avail = o->cap - o->len;
+    if (avail > 0) {
+      memcpy(o->buf + o->len, p, avail);
+      o->len += avail;
+      p += avail;
+      n -= avail;
+    }
+    if (o->grow == NULL || o->failed) return;
+    if (!o->grow(o, n)) {
+      o->failed = true;
+      return;
+    }
+  }
+  if (n > 0) memcpy(o->buf + o->len, p, n);
+  o->len += n;
+}
+
+static void
+out_byte(struct json_out *o, unsigned char c)
+{
+  if (o->len < o->cap) {
+    ++o->total;
+    o->buf[o->len++] = c;
+  } else {
+    out_write(o, &c, 1);
+  }
+}
+
+static bool
+out_grow_alloc(struct json_out *o, ptrdiff_t need)
+{
+  struct json_allocator *al = o->ctx;
+  ptrdiff_t new_cap = o->cap ? 2*o->cap : 256;
+  while (new_cap - o->len < need) new_cap *= 2;
+  unsigned char *tmp = al->al_malloc(new_cap, al->ctx);
+  if (tmp == NULL) return false;
+  if (o->buf) {
+    memcpy(tmp, o->buf, o->len);
+    al->al_free(o->buf, al->ctx);
+  }
+  o->buf = tmp;
+  o->cap = new_cap;
+  return true;
+}
+
+// Non zero when one of the 8 bytes in w is a quote, a backslash or a control
+// character, which all need escaping.
+static uint64_t
+swar_needs_escape(uint64_t w)
+{
+  const uint64_t ones = 0x0101010101010101u;
+  const uint64_t high = 0x8080808080808080u;
+  uint64_t q = w ^ (ones * '"');
+  uint64_t b = w ^ (ones * '\\');
+  uint64_t ctl = (w - ones * 0x20) & ~w;
+  q = (q - ones) & ~q;
+  b = (b - ones) & ~b;
+  return (ctl | q | b) & high;
+}
+
+static void
+out_string(struct json_out *o, ustring str)
+{
+  static const char hex[] = "0123456789abcdef";
+  const unsigned char *s = str.s;
+  ptrdiff_t n = str.len;
+  ptrdiff_t run = 0;
+  out_byte(o, '"');
+  for (ptrdiff_t i = 0; i < n;) {
+    if (n - i >= 8) {
+      uint64_t w;
+      memcpy(&w, s + i, 8);
+      if (swar_needs_escape(w) == 0) {
+        i += 8;
+        continue;
+      }
+    }
+    unsigned char c = s[i];
+    if (c >= 0x20 && c != '"' && c != '\\') {
+      ++i;
+      continue;
+    }
+    out_write(o, s + run, i - run);
+    unsigned char esc[6] = {'\\', 0};
+    int len = 2;
+    switch (c) {
+    case '"': esc[1] = '"'; break;
+    case '\\': esc[1] = '\\'; break;
+    case '\b': esc[1] = 'b'; break;
+    case '\f': esc[1] = 'f'; break;
+    case '\n': esc[1] = 'n'; break;
+    case '\r': esc[1] = 'r'; break;
+    case '\t': esc[1] = 't'; break;
+    default:
+      esc[1] = 'u';
+      esc[2] = '0';
+      esc[3] = '0';
+      esc[4] = hex[c >> 4];
+      esc[5] = hex[c & 0xF];
+      len = 6;
+      break;
+    }
+    out_write(o, esc, len);
+    run = ++i;
+  }
+  out_write(o, s + run, n - run);
+  out_byte(o, '"');
+}
+
+// Grisu2 from Loitsch's "Printing Floating-Point Numbers Quickly and
+// Accurately" in 64 bit integers: the digits always read back as the same
+// double and are the shortest for all but a few. No snprintf, strtod or
+// locale involved.
+struct diy_fp {
+  uint64_t f;
+  int e;
+};
+
+// 10^k for k = -348, -340, ..., 340 as f * 2^e with the top bit of f set.
+static const uint64_t cached_pow10_f[] = {
+  0xfa8fd5a0081c0288, 0xbaaee17fa23ebf76, 0x8b16fb203055ac76,
+  0xcf42894a5dce35ea, 0x9a6bb0aa55653b2d, 0xe61acf033d1a45df,
+  0xab70fe17c79ac6ca, 0xff77b1fcbebcdc4f, 0xbe5691ef416bd60c,
+  0x8dd01fad907ffc3c, 0xd3515c2831559a83, 0x9d71ac8fada6c9b5,
+  0xea9c227723ee8bcb, 0xaecc49914078536d, 0x823c12795db6ce57,
+  0xc21094364dfb5637, 0x9096ea6f3848984f, 0xd77485cb25823ac7,
+  0xa086cfcd97bf97f4, 0xef340a98172aace5, 0xb23867fb2a35b28e,
+  0x84c8d4dfd2c63f3b, 0xc5dd44271ad3cdba, 0x936b9fcebb25c996,
+  0xdbac6c247d62a584, 0xa3ab66580d5fdaf6, 0xf3e2f893dec3f126,
+  0xb5b5ada8aaff80b8, 0x87625f056c7c4a8b, 0xc9bcff6034c13053,
+  0x964e858c91ba2655, 0xdff9772470297ebd, 0xa6dfbd9fb8e5b88f,
+  0xf8a95fcf88747d94, 0xb94470938fa89bcf, 0x8a08f0f8bf0f156b,
+  0xcdb02555653131b6, 0x993fe2c6d07b7fac, 0xe45c10c42a2b3b06,
+  0xaa242499697392d3, 0xfd87b5f28300ca0e, 0xbce5086492111aeb,
+  0x8cbccc096f5088cc, 0xd1b71758e219652c, 0x9c40000000000000,
+  0xe8d4a51000000000, 0xad78ebc5ac620000, 0x813f3978f8940984,
+  0xc097ce7bc90715b3, 0x8f7e32ce7bea5c70, 0xd5d238a4abe98068,
+  0x9f4f2726179a2245, 0xed63a231d4c4fb27, 0xb0de65388cc8ada8,
+  0x83c7088e1aab65db, 0xc45d1df942711d9a, 0x924d692ca61be758,
+  0xda01ee641a708dea, 0xa26da3999aef774a, 0xf209787bb47d6b85,
+  0xb454e4a179dd1877, 0x865b86925b9bc5c2, 0xc83553c5c8965d3d,
+  0x952ab45cfa97a0b3, 0xde469fbd99a05fe3, 0xa59bc234db398c25,
+  0xf6c69a72a3989f5c, 0xb7dcbf5354e9bece, 0x88fcf317f22241e2,
+  0xcc20ce9bd35c78a5, 0x98165af37b2153df, 0xe2a0b5dc971f303a,
+  0xa8d9d1535ce3b396, 0xfb9b7cd9a4a7443c, 0xbb764c4ca7a44410,
+  0x8bab8eefb6409c1a, 0xd01fef10a657842c, 0x9b10a4e5e9913129,
+  0xe7109bfba19c0c9d, 0xac2820d9623bf429, 0x80444b5e7aa7cf85,
+  0xbf21e44003acdd2d, 0x8e679c2f5e44ff8f, 0xd433179d9c8cb841,
+  0x9e19db92b4e31ba9, 0xeb96bf6ebadf77d9, 0xaf87023b9bf0ee6b
+};
+static const int16_t cached_pow10_e[] = {
+  -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954, -927,
+  -901, -874, -847, -821, -794, -768, -741, -715, -688, -661, -635, -608,
+  -582, -555, -529, -502, -475, -449, -422, -396, -369, -343, -316, -289,
+  -263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3, 30,
+  56, 83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+  375, 402, 428, 455, 481, 508, 534, 561, 588, 614, 641, 667,
+  694, 720, 747, 774, 800, 827, 853, 880, 907, 933, 960, 986,
+  1013, 1039, 1066
+};
+
+static const uint64_t pow10_u64[20] = {
+  1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000,
+  10000000000u, 100000000000u, 1000000000000u, 10000000000000u, 100000000000000u,
+  1000000000000000u, 10000000000000000u, 100000000000000000u, 1000000000000000000u,
+  10000000000000000000u
+};
+
+// Top 64 bits of the product, rounded.
+static struct diy_fp
+diy_fp_mul(struct diy_fp a, struct diy_fp b)
+{
+  const uint64_t m32 = 0xFFFFFFFF;
+  uint64_t ah = a.f >> 32, al = a.f & m32, bh = b.f >> 32, bl = b.f & m32;
+  uint64_t hh = ah*bh, hl = ah*bl, lh = al*bh, ll = al*bl;
+  uint64_t mid = (ll >> 32) + (hl & m32) + (lh & m32) + ((uint64_t)1 << 31);
+  return (struct diy_fp){hh + (hl >> 32) + (lh >> 32) + (mid >> 32), a.e + b.e + 64};
+}
+
+static struct diy_fp
+diy_fp_normalize(struct diy_fp x)
+{
+  while (!(x.f >> 63)) {
+    x.f <<= 1;
+    x.e--;
+  }
+  return x;
+}
+
+// Moves the last digit towards w while the result stays inside the bounds.
+static void
+grisu_round(char *buf, int len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w)
+{
+  while (rest < wp_w && delta - rest >= ten_kappa &&
+         (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+    buf[len - 1]--;
+    rest += ten_kappa;
+  }
+}
+
+// Writes the digits of a positive finite num into buf, num is digits * 10^*exp.
 static int
-process_directory(const char *dirpath)
+grisu2(double num, char buf[static 20], int *exp)
 {
-    DIR *dir = opendir(dirpath);
-    if (!dir) {
-        perror("opendir");
-        return 1;
+  uint64_t bits;
+  memcpy(&bits, &num, sizeof(bits));
+  uint64_t frac = bits & (((uint64_t)1 << 52) - 1);
+  int biased = (int)(bits >> 52);
+  struct diy_fp v = biased ? (struct diy_fp){frac | (uint64_t)1 << 52, biased - 1075}
+                           : (struct diy_fp){frac, -1074};
+
+  // Halfway to the neighbouring doubles, the one below is closer when v is a
+  // power of two.
+  struct diy_fp plus = diy_fp_normalize((struct diy_fp){(v.f << 1) + 1, v.e - 1});
+  struct diy_fp minus = frac == 0 && biased > 1 ? (struct diy_fp){(v.f << 2) - 1, v.e - 2}
+                                                : (struct diy_fp){(v.f << 1) - 1, v.e - 1};
+  minus.f <<= minus.e - plus.e;
+  minus.e = plus.e;
+
+  // Scale by a cached power so the product's exponent lands in [-60, -32].
+  double dk = (-61 - plus.e) * 0.30102999566398114 + 347;
+  int k = (int)dk;
+  if (dk - k > 0) k++;
+  int idx = (k >> 3) + 1;
+  *exp = 348 - idx*8;
+  struct diy_fp c = {cached_pow10_f[idx], cached_pow10_e[idx]};
+  struct diy_fp w = diy_fp_mul(diy_fp_normalize(v), c);
+  struct diy_fp wp = diy_fp_mul(plus, c), wm = diy_fp_mul(minus, c);
+  wm.f++;
+  wp.f--;
+
+  // Digits of wp until what is left fits between wm and wp.
+  int shift = -wp.e;
+  uint64_t one = (uint64_t)1 << shift;
+  uint64_t delta = wp.f - wm.f, wp_w = wp.f - w.f;
+  uint32_t p1 = (uint32_t)(wp.f >> shift);
+  uint64_t p2 = wp.f & (one - 1);
+  int kappa = 1;
+  while (kappa < 10 && p1 >= pow10_u64[kappa]) kappa++;
+  int len = 0;
+  while (kappa > 0) {
+    uint32_t d = p1 / (uint32_t)pow10_u64[kappa - 1];
+    p1 %= (uint32_t)pow10_u64[kappa - 1];
+    if (d || len) buf[len++] = (char)('0' + d);
+    kappa--;
+    uint64_t rest = ((uint64_t)p1 << shift) + p2;
+    if (rest <= delta) {
+      *exp += kappa;
+      grisu_round(buf, len, delta, rest, pow10_u64[kappa] << shift, wp_w);
+      return len;
     }
-    int result = 0;
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-            continue;
+  }
+  for (;;) {
+    p2 *= 10;
+    delta *= 10;
+    char d = (char)(p2 >> shift);
+    if (d || len) buf[len++] = (char)('0' + d);
+    p2 &= one - 1;
+    kappa--;
+    if (p2 < delta) {
+      *exp += kappa;
+      grisu_round(buf, len, delta, p2, one, -kappa < 20 ? wp_w * pow10_u64[-kappa] : 0);
+      return len;
+    }
+  }
+}
 
-        char fullpath[4096];
-        snprintf(fullpath, sizeof(fullpath), "%s/%s", dirpath, entry->d_name);
+// Shortest digits from grisu2 laid out like %g would with at least 15 digits
+// of precision, integers take a fast path.
+static int
+format_number(double num, char buf[static 32])
+{
+  if (num != num || num - num != 0) {
+    memcpy(buf, "null", 5);
+    return 4;
+  }
+  char *p = buf;
+  if (signbit(num)) {
+    *p++ = '-';
+    num = -num;
+  }
+  char digits[20];
+  int n, exp;
+  if (num <= 9007199254740992.0 && num == (double)(int64_t)num) {
+    uint64_t u = (uint64_t)num;
+    char tmp[20];
+    n = 0;
+    do {
+      tmp[n++] = (char)('0' + u % 10);
+      u /= 10;
+    } while (u);
+    while (n > 0) *p++ = tmp[--n];
+    *p = '\0';
+    return (int)(p - buf);
+  }
+  n = grisu2(num, digits, &exp);
+  while (n > 1 && digits[n - 1] == '0') {
+    n--;
+    exp++;
+  }
+  int x = n - 1 + exp;  // exponent of the first digit
+  if (x < -4 || x >= (n > 15 ? n : 15)) {
+    *p++ = digits[0];
+    if (n > 1) {
+      *p++ = '.';
+      memcpy(p, digits + 1, n - 1);
+      p += n - 1;
+    }
+    *p++ = 'e';
+    *p++ = x < 0 ? '-' : '+';
+    if (x < 0) x = -x;
+    if (x >= 100) *p++ = (char)('0' + x/100);
+    *p++ = (char)('0' + x/10%10);
+    *p++ = (char)('0' + x%10);
+  } else if (x < 0) {
+    *p++ = '0';
+    *p++ = '.';
+    for (int i = x + 1; i < 0; ++i) *p++ = '0';
+    memcpy(p, digits, n);
+    p += n;
+  } else if (x >= n - 1) {
+    memcpy(p, digits, n);
+    p += n;
+    for (int i = n - 1; i < x; ++i) *p++ = '0';
+  } else {
+    memcpy(p, digits, x + 1);
+    p += x + 1;
+    *p++ = '.';
+    memcpy(p, digits + x + 1, n - x - 1);
+    p += n - x - 1;
+  }
+  *p = '\0';
+  return (int)(p - buf);
+}
 
-        struct stat st;
-        if (stat(fullpath, &st) != 0) {
-            perror("stat");
-            continue;
-        }
+static void
+out_number(struct json_out *o, double num)
+{
+  char buf[32];
+  out_write(o, buf, format_number(num, buf));
+}
 
-        if (S_ISREG(st.st_mode)) {
-            size_t length = 0;
-            unsigned char *content = (unsigned char *)read_file_to_string(fullpath, &length);
-            struct json_string_source_ctx ssc = make_ss(content, length);
-            unsigned char *begin = content;
-            if (content) {
-                struct json_parser *p = make_parser(string_source_make(&ssc), lib_allocator);
-                json_parser_set_max_depth(p, 200);
-                json_parse(p);
-                
-                if (entry->d_name[0] == 'y') {
-                  result += p->json_node.type != JSON_ERROR ? 0 : 1;
-                } else if (entry->d_name[0] == 'n') {
-                  result += p->json_node.type != JSON_ERROR ? 1 : 0;
-                } else if (entry->d_name[0] == 'i') {
-                  fprintf(stdout, "Test on file %s : %s\n", entry->d_name, p->json_node.type == JSON_ERROR ? "DISALLOWED" : "ALLOWED");
-                }
-                if (result != 0) return 1;
-                destroy_parser(p);
-                free(begin);
-            }
-        }
+static void
+out_indent(struct json_out *o, int level)
+{
+  static const char spaces[] = "                                ";
+  out_byte(o, '\n');
+  for (ptrdiff_t n = 2*(ptrdiff_t)level; n > 0; n -= sizeof(spaces) - 1) {
+    out_write(o, spaces, n < (ptrdiff_t)sizeof(spaces) - 1 ? n : (ptrdiff_t)sizeof(spaces) - 1);
+  }
+}
+
+// A container serialize_node is writing the children of.
+struct json_out_frame {
+  const struct json_ast_node *node;
+  ptrdiff_t next;  // index of the next child
+};
+
+// Frames serialize_node keeps on the C stack, deeper documents need al.
+#define JSON_OUT_STACK 256
+
+// Writes v without recursing, the open containers live on an explicit stack.
+// It starts on the C stack and moves to al when it outgrows it, without al
+// documents nested deeper than JSON_OUT_STACK fail.
+static void
+serialize_node(struct json_out *o, const struct json_ast_node *v, int flags, int level,
+               const struct json_allocator *al)
+{
+  bool pretty = flags & JSON_WRITE_PRETTY;
+  struct json_out_frame local[JSON_OUT_STACK];
+  struct json_out_frame *stack = local;
+  ptrdiff_t len = 0;
+  ptrdiff_t cap = JSON_OUT_STACK;
+
+ value:
+  switch (v->type) {
+  case JSON_NULL:
+    out_write(o, "null", 4);
+    break;
+  case JSON_BOOL:
+    if (v->value.b) out_write(o, "true", 4);
+    else out_write(o, "false", 5);
+    break;
+  case JSON_NUMBER:
+    out_number(o, v->value.num);
+    break;
+  case JSON_STRING:
+    out_string(o, v->value.s);
+    break;
+  case JSON_ARRAY:
+  case JSON_OBJECT:
+    if (len == cap) {
+      struct json_out_frame *tmp = al ? al->al_malloc(2*cap*sizeof(*tmp), al->ctx) : NULL;
+      if (tmp == NULL) {
+        o->failed = true;
+        goto done;
+      }
+      memcpy(tmp, stack, len*sizeof(*tmp));
+      if (stack != local) al->al_free(stack, al->ctx);
+      stack = tmp;
+      cap *= 2;
+    }
+    stack[len++] = (struct json_out_frame){ .node = v, .next = 0 };
+    out_byte(o, v->type == JSON_ARRAY ? '[' : '{');
+    break;
+  case JSON_ERROR:
+    o->failed = true;
+    goto done;
+  }
+
+  while (len > 0 && !o->failed) {
+    struct json_out_frame *f = &stack[len - 1];
+    const struct json_ast_node *c = f->node;
+    int child_level = level + (int)len;
+    ptrdiff_t n = c->type == JSON_ARRAY ? c->value.vec.len : c->value.obj.len;
+    if (f->next < n) {
+      ptrdiff_t i = f->next++;
+      if (i) out_byte(o, ',');
+      if (pretty) out_indent(o, child_level);
+      if (c->type == JSON_ARRAY) {
+        v = c->value.vec.arr + i;
+      } else {
+        out_string(o, c->value.obj.keys[i]);
+        if (pretty) out_write(o, ": ", 2);
+        else out_byte(o, ':');
+        v = c->value.obj.vals + i;
+      }
+      goto value;
+    }
+    --len;
+    if (pretty && n) out_indent(o, child_level - 1);
+    out_byte(o, c->type == JSON_ARRAY ? ']' : '}');
+  }
+
+ done:
+  if (stack != local) al->al_free(stack, al->ctx);
+}
+
+ptrdiff_t
+json_serialize(const Json_View *v, int flags, unsigned char *buf, ptrdiff_t cap)
+{
+  struct json_out o = { .buf = buf, .cap = cap > 0 ? cap - 1 : 0 };
+  serialize_node(&o, v, flags, 0, NULL);
+  if (cap > 0) buf[o.len] = '\0';
+  return o.failed ? -1 : o.total;
+}
+
+ustring
+json_serialize_alloc(const Json_View *v, int flags, struct json_allocator al)
+{
+  struct json_out o = { .grow = out_grow_alloc, .ctx = &al };
+  serialize_node(&o, v, flags, 0, &al);
+  if (!o.failed) out_byte(&o, '\0');
+  if (o.failed) {
+    if (o.buf) al.al_free(o.buf, al.ctx);
+    return (ustring){0};
+  }
+  return (ustring){ .s = o.buf, .len = o.len - 1 };
+}
+
+#define JSON_WRITER_BUF_SIZE (64*1024)
+#define JSON_WRITER_MAX_DEPTH 256
+
+enum json_writer_frame {
+  JW_OBJECT = 1,  // the container is an object, otherwise an array
+  JW_ITEMS = 2,   // something was written into it, the next item needs a comma
+  JW_KEY = 4      // a key was written and its value is expected next
+};
+
+struct json_writer {
+  struct json_out out;
+  struct json_sink sink;
+  struct json_allocator allocator;
+  int flags;
+  int depth;
+  bool misused;
+  bool has_root;
+  unsigned char frames[JSON_WRITER_MAX_DEPTH];
+};
+
+static bool
+writer_flush(struct json_out *o, ptrdiff_t need)
+{
+  (void)need;
+  struct json_writer *w = o->ctx;
+  if (o->len && !w->sink.write(o->buf, o->len, w->sink.ctx)) return false;
+  o->len = 0;
+  return true;
+}
+
+#ifdef JP_POSIX
+static bool
+sink_fd_write(const unsigned char *buf, ptrdiff_t len, void *ctx)
+{
+  int fd = (int)(intptr_t)ctx;
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+#endif
+
+static bool
+sink_file_write(const unsigned char *buf, ptrdiff_t len, void *ctx)
+{
+  return fwrite(buf, 1, len, ctx) == (size_t)len;
+}
+
+#ifdef JP_POSIX
+struct json_sink
+json_fd_sink(int fd)
+{
+  return (struct json_sink){ .write = sink_fd_write, .ctx = (void *)(intptr_t)fd };
+}
+#endif
+
+struct json_sink
+json_file_sink(FILE *f)
+{
+  return (struct json_sink){ .write = sink_file_write, .ctx = f };
+}
+
+Json_Writer *
+make_writer(struct json_sink sink, struct json_allocator al, int flags)
+{
+  struct json_writer *w = al.al_malloc(sizeof(struct json_writer), al.ctx);
+  if (w == NULL) return NULL;
+  w->out = (struct json_out){ .grow = writer_flush, .ctx = w };
+  w->out.buf = al.al_malloc(JSON_WRITER_BUF_SIZE, al.ctx);
+  if (w->out.buf == NULL) {
+    al.al_free(w, al.ctx);
+    return NULL;
+  }
+  w->out.cap = JSON_WRITER_BUF_SIZE;
+  w->sink = sink;
+  w->allocator = al;
+  w->flags = flags;
+  w->depth = 0;
+  w->misused = false;
+  w->has_root = false;
+  return w;
+}
+
+static bool
+writer_ok(struct json_writer *w)
+{
+  return !(w->misused || w->out.failed);
+}
+
+static bool
+writer_misuse(struct json_writer *w)
+{
+  w->misused = true;
+  return false;
+}
+
+// Writes the separator that goes before a value and checks one is allowed.
+static bool
+writer_before_value(struct json_writer *w)
+{
+  if (!writer_ok(w)) return false;
+  if (w->depth == 0) {
+    // several top level values are written one per line
+    if (w->has_root) out_byte(&w->out, '\n');
+    return true;
+  }
+  unsigned char *f = &w->frames[w->depth - 1];
+  if (*f & JW_OBJECT) {
+    if ((*f & JW_KEY) == 0) return writer_misuse(w);
+    *f &= ~JW_KEY;
+    return true;
+  }
+  if (*f & JW_ITEMS) out_byte(&w->out, ',');
+  *f |= JW_ITEMS;
+  if (w->flags & JSON_WRITE_PRETTY) out_indent(&w->out, w->depth);
+  return true;
+}
+
+static bool
+writer_after_value(struct json_writer *w)
+{
+  if (w->depth == 0) w->has_root = true;
+  return writer_ok(w);
+}
+
+static bool
+writer_begin(struct json_writer *w, unsigned char frame, unsigned char c)
+{
+  if (!writer_before_value(w)) return false;
+  if (w->depth == JSON_WRITER_MAX_DEPTH) return writer_misuse(w);
+  w->frames[w->depth++] = frame;
+  out_byte(&w->out, c);
+  return writer_ok(w);
+}
+
+static bool
+writer_end(struct json_writer *w, unsigned char frame, unsigned char c)
+{
+  if (!writer_ok(w)) return false;
+  if (w->depth == 0) return writer_misuse(w);
+  unsigned char f = w->frames[w->depth - 1];
+  if ((f & JW_OBJECT) != frame || (f & JW_KEY)) return writer_misuse(w);
+  --w->depth;
+  if ((w->flags & JSON_WRITE_PRETTY) && (f & JW_ITEMS)) out_indent(&w->out, w->depth);
+  out_byte(&w->out, c);
+  return writer_after_value(w);
+}
+
+bool json_write_begin_object(Json_Writer *w)
+{
+  return writer_begin(w, JW_OBJECT, '{');
+}
+bool json_write_end_object(Json_Writer *w)
+{
+  return writer_end(w, JW_OBJECT, '}');
+}
+bool json_write_begin_array(Json_Writer *w)
+{
+  return writer_begin(w, 0, '[');
+}
+bool json_write_end_array(Json_Writer *w)
+{
+  return writer_end(w, 0, ']');
+}
+bool json_write_key(Json_Writer *w, ustring key)
+{
+  if (!writer_ok(w)) return false;
+  if (w->depth == 0) return writer_misuse(w);
+  unsigned char *f = &w->frames[w->depth - 1];
+  if ((*f & JW_OBJECT) == 0 || (*f & JW_KEY)) return writer_misuse(w);
+  if (*f & JW_ITEMS) out_byte(&w->out, ',');
+  *f |= JW_ITEMS | JW_KEY;
+  if (w->flags & JSON_WRITE_PRETTY) out_indent(&w->out, w->depth);
+  out_string(&w->out, key);
+  if (w->flags & JSON_WRITE_PRETTY) out_write(&w->out, ": ", 2);
+  else out_byte(&w->out, ':');
+  return writer_ok(w);
+}
+bool json_write_string(Json_Writer *w, ustring s)
+{
+  if (!writer_before_value(w)) return false;
+  out_string(&w->out, s);
+  return writer_after_value(w);
+}
+bool json_write_number(Json_Writer *w, double num)
+{
+  if (!writer_before_value(w)) return false;
+  out_number(&w->out, num);
+  return writer_after_value(w);
+}
+bool json_write_int(Json_Writer *w, long long num)
+{
+  if (!writer_before_value(w)) return false;
+  char buf[32];
+  out_write(&w->out, buf, snprintf(buf, sizeof(buf), "%lld", num));
+  return writer_after_value(w);
+}
+bool json_write_bool(Json_Writer *w, bool b)
+{
+  if (!writer_before_value(w)) return false;
+  if (b) out_write(&w->out, "true", 4);
+  else out_write(&w->out, "false", 5);
+  return writer_after_value(w);
+}
+bool json_write_null(Json_Writer *w)
+{
+  if (!writer_before_value(w)) return false;
+  out_write(&w->out, "null", 4);
+  return writer_after_value(w);
+}
+bool json_write_view(Json_Writer *w, const Json_View *v)
+{
+  if (!writer_before_value(w)) return false;
+  serialize_node(&w->out, v, w->flags, w->depth, &w->allocator);
+  return writer_after_value(w);
+}
+bool json_writer_flush(Json_Writer *w)
+{
+  if (!w->out.failed && !writer_flush(&w->out, 0)) w->out.failed = true;
+  return writer_ok(w);
+}
+
+bool
+destroy_writer(Json_Writer *w)
+{
+  bool ok = json_writer_flush(w) && w->depth == 0;
+  w->allocator.al_free(w->out.buf, w->allocator.ctx);
+  w->allocator.al_free(w, w->allocator.ctx);
+  return ok;
+}
+
+#ifdef TEST
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <locale.h>
+#include <string.h>
+#include <stdio.h>
+
+struct json_string_source_ctx {
+  unsigned char *json_string;
+  ptrdiff_t len;
+  ptrdiff_t cursor;
+};
+
+static void
+str_next_byte(void *ctx)
+{
+  struct json_string_source_ctx *ss = ctx;
+  ++ss->cursor;
+}
+
+static unsigned char
+str_get_byte(void *ctx)
+{
+  struct json_string_source_ctx *ss = ctx;
+  return ss->json_string[ss->cursor];
+}
+
+static bool
+str_has_next_byte(void *ctx)
+{
+  struct json_string_source_ctx *ss = ctx;
+  return (ss->cursor < ss->len);
+}
+
+static void
+str_rewind(void *ctx)
+{
+  struct json_string_source_ctx *ss = ctx;
+  ss->cursor = 0;
+}
+
+struct json_string_source_ctx make_ss(unsigned char *str, ptrdiff_t len) {
+  return (struct json_string_source_ctx){.json_string = str, .len = len, .cursor = 0};
+}
+
+struct json_source string_source_make(struct json_string_source_ctx *ctx) {
+  return (struct json_source){ .next = str_next_byte, .get_byte = str_get_byte, .has_next = str_has_next_byte, .ctx = ctx, .rewind = str_rewind};
+}
+
+static void
+print_json_node_helper(const struct json_parser *p, const struct json_ast_node node, int level)
+{
+  switch (node.type) {
+  case JSON_NULL:
+    printf("null");
+    break;
+  case JSON_BOOL:
+    printf("%s", (node.value.b ? "true" : "false"));
+    break;
+  case JSON_ARRAY:
+    printf("[\n");
+    for (int i = 0; i < level; ++i) printf("\t");
+    if (node.value.vec.len) {
+      print_json_node_helper(p, node.value.vec.arr[0], level+1);
+    }
+
+    for (ptrdiff_t i = 1; i < node.value.vec.len; ++i) {
+      printf(",\n");
+      for (int i = 0; i < level; ++i) printf("\t");
+      print_json_node_helper(p, node.value.vec.arr[i], level+1);
+    }
+    printf("\n");
+    for (int i = 0; i < level-1; ++i) printf("\t");
+    printf("]");
+    break;
+  case JSON_OBJECT:
+    printf("{\n");
+    for (int i = 0; i < level; ++i) printf("\t");
+    if (node.value.obj.len) {
+      printf("\"%s\"", (char *)node.value.obj.keys[0].s);
+      printf(" : ");
+      print_json_node_helper(p, node.value.obj.vals[0], level+1);
+    }
+
+    for(ptrdiff_t i = 1; i < node.value.obj.len; ++i) {
+      printf(",\n");
+      for (int i = 0; i < level; ++i) printf("\t");
+      printf("\"%s\"", (char *)node.value.obj.keys[i].s);
+      printf(" : ");
+      print_json_node_helper(p, node.value.obj.vals[i], level+1);
+    }
+    printf("\n");
+    for (int i = 0; i < level-1; ++i) printf("\t");
+    printf("}");
+    break;
+  case JSON_NUMBER:
+    printf("%lf", node.value.num);
+    break;
+  case JSON_STRING:
+    printf("\"%s\"", (char *)node.value.s.s);
+    break;
+  case JSON_ERROR:
+    printf("At line number: %d, char number %d %s", json_parser_linenum(p), json_parser_position(p), err_lookup_table[node.value.err_code]);
+    break;
+  }
+}
+
+static void
+print_json_node(const struct json_parser *p, const struct json_ast_node node)
+{
+  print_json_node_helper(p, node, 1);
+}
+
+static char *
+read_file_to_string(const char *path, size_t *out_len)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        perror("fopen");
+        return NULL;
+    }
+
+    if (fseek(fp, 0, SEEK_END) != 0) {
+        perror("fseek");
+        fclose(fp);
+        return NULL;
+    }
+
+    long len = ftell(fp);
+    if (len < 0) {
+        perror("ftell");
+        fclose(fp);
+        return NULL;
+    }
+
+    rewind(fp);
+
+    char *buffer = malloc(len + 1);
+    if (!buffer) {
+        perror("malloc");
+        fclose(fp);
+        return NULL;
+    }
+
+    if (fread(buffer, 1, len, fp) != (size_t)len) {
+        perror("fread");
+        free(buffer);
+        fclose(fp);
+        return NULL;
+    }
+
+    buffer[len] = '\0';
+    fclose(fp);
+
+    if (out_len) *out_len = (size_t)len;
+    return buffer;
+}
+
+static int
+process_directory(const char *dirpath)
+{
+    DIR *dir = opendir(dirpath);
+    if (!dir) {
+        perror("opendir");
+        return 1;
+    }
+    int result = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        char fullpath[4096];
+        snprintf(fullpath, sizeof(fullpath), "%s/%s", dirpath, entry->d_name);
+
+        struct stat st;
+        if (stat(fullpath, &st) != 0) {
+            perror("stat");
+            continue;
+        }
+
+        if (S_ISREG(st.st_mode)) {
+            size_t length = 0;
+            unsigned char *content = (unsigned char *)read_file_to_string(fullpath, &length);
+            struct json_string_source_ctx ssc = make_ss(content, length);
+            unsigned char *begin = content;
+            if (content) {
+                struct json_parser *p = make_parser(string_source_make(&ssc), lib_allocator);
+                json_parser_set_max_depth(p, 200);
+                json_parse(p);
+                
+                if (entry->d_name[0] == 'y') {
+                  result += p->json_node.type != JSON_ERROR ? 0 : 1;
+                } else if (entry->d_name[0] == 'n') {
+                  result += p->json_node.type != JSON_ERROR ? 1 : 0;
+                } else if (entry->d_name[0] == 'i') {
+                  fprintf(stdout, "Test on file %s : %s\n", entry->d_name, p->json_node.type == JSON_ERROR ? "DISALLOWED" : "ALLOWED");
+                }
+                if (result != 0) return 1;
+                destroy_parser(p);
+                free(begin);
+            }
+        }
+    }
+
+    closedir(dir);
+    return result;
+}
+
+static int test_parse_null() {
+  unsigned char * str = (unsigned char *)"null";
+    struct json_string_source_ctx ssc = make_ss(str, strlen((char *)str));
+    Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
+    const Json_View *v = json_parse(p);
+    if (!(json_type(v) == JSON_NULL)) return 1;
+    fprintf(stdout, "test parse null : SUCCESS\n");
+    destroy_parser(p);
+    return 0;
+}
+
+static int test_parse_bool() {
+  unsigned char * str = (unsigned char *)"true";
+    struct json_string_source_ctx ssc = make_ss(str, strlen((char *)str));
+    Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
+    const Json_View *v = json_parse(p);
+    if (!(json_type(v) == JSON_BOOL)) return 1;
+    if (!(json_bool(v) == true)) return 1;
+    fprintf(stdout, "test parse bool : SUCCESS\n");
+    destroy_parser(p);
+    return 0;
+}
+
+static int test_parse_number() {
+  unsigned char * str = (unsigned char *)"123.45";
+    struct json_string_source_ctx ssc = make_ss(str, strlen((char *)str));
+    Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
+    const Json_View *v = json_parse(p);
+    if (!(json_type(v) == JSON_NUMBER)) return 1;
+    if (!(json_number(v) == 123.45)) return 1;
+    fprintf(stdout, "test parse number : SUCCESS\n");
+    destroy_parser(p);
+    return 0;
+}
+
+static int test_parse_string() {
+  unsigned char * str = (unsigned char *)"\"hello\"";
+    struct json_string_source_ctx ssc = make_ss(str, strlen((char *)str));
+    Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
+    const Json_View *v = json_parse(p);
+    if (!(json_type(v) == JSON_STRING)) return 1;
+    ustring s = json_string(v);
+    if (!(memcmp(s.s, "hello", s.len) == 0)) return 1;
+    fprintf(stdout, "test parse string : SUCCESS\n");
+    destroy_parser(p);
+    return 0;
+}
+
+static int test_parse_array() {
+    unsigned char * str = (unsigned char *)"[1, true, null, {\"a\": 1}]";
+    struct json_string_source_ctx ssc = make_ss(str, strlen((char *)str));
+    Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
+    const Json_View *v = json_parse(p);
+    if (!(json_type(v) == JSON_ARRAY)) return 1;
+    if (!(json_array_len(v) == 4)) return 1;
+    if (!(json_type(json_array_at(v, 0)) == JSON_NUMBER)) return 1;
+    if (!(json_number(json_array_at(v, 0)) == 1)) return 1;
+    if (!(json_bool(json_array_at(v, 1)) == true)) return 1;
+    if (!(json_type(json_array_at(v, 2)) == JSON_NULL)) return 1;
+    if (!(json_type(json_array_at(v, 3)) == JSON_OBJECT)) return 1;
+    fprintf(stdout, "test parse array : SUCCESS\n");
+    destroy_parser(p);
+    return 0;
+}
+
+static int test_parse_object() {
+    unsigned char * str = (unsigned char *)"{\"a\": 1, \"b\": false}";
+    struct json_string_source_ctx ssc = make_ss(str, strlen((char *)str));
+    Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
+    const Json_View *v = json_parse(p);
+    if (!(json_type(v) == JSON_OBJECT)) return 1;
+    ptrdiff_t count = 0;
+
+    const ustring *keys = json_object_keys(v, &count);
+    if (!(count == 2)) return 1;
+    const Json_View *val = json_object_val(v, (ustring){.s = (unsigned char *)"a", .len = 1});
+    if (!(val->type == JSON_NUMBER)) return 1;
+    if (!(json_number(val) == 1.0)) return 1;
+    val = json_object_val(v, (ustring){.s = (unsigned char *)"b", .len = 1});
+    if (!(val->type == JSON_BOOL)) return 1;
+    if (!(json_bool(val) == false)) return 1;
+    fprintf(stdout, "test parse object : SUCCESS\n");
+    destroy_parser(p);
+    return 0;
+}
+
+static void *
+fail_second_malloc(ptrdiff_t sz, void *ctx)
+{
+  int *calls = ctx;
+  return ++*calls == 2 ? NULL : malloc(sz);
+}
+
+static int test_parser_reset() {
+    unsigned char * str = (unsigned char *)"{\"a\": [1, 2, 3], \"b\": \"hello\"}";
+    struct json_string_source_ctx ssc = make_ss(str, strlen((char *)str));
+    Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
+    const Json_View *v = json_parse(p);
+    if (!(json_type(v) == JSON_OBJECT)) return 1;
+    Arena *block = p->pool.head;
+
+    json_parser_reset(p);
+    ssc.cursor = 0;
+    v = json_parse(p);
+    if (!(json_type(v) == JSON_OBJECT)) return 1;
+    if (!(p->pool.head == block && p->pool.cur == block)) return 1;
+
+    json_parser_set_arena_high_water(p, 0);
+    json_parser_reset(p);
+    if (!(p->pool.head == NULL && p->pool.next_size == INIT_ARENA_SIZE)) return 1;
+    ssc.cursor = 0;
+    v = json_parse(p);
+    if (!(json_type(v) == JSON_OBJECT)) return 1;
+    destroy_parser(p);
+
+    // no parser when its first block can't be had
+    struct json_allocator failing = lib_allocator;
+    failing.al_malloc = fail_second_malloc;
+    int calls = 0;
+    failing.ctx = &calls;
+    if (!(make_parser(string_source_make(&ssc), failing) == NULL)) return 1;
+    fprintf(stdout, "test parser reset : SUCCESS\n");
+    return 0;
+}
+
+static int test_parse_large_array() {
+    ptrdiff_t n = 200000;
+    unsigned char *str = malloc(n*8 + 2);
+    ptrdiff_t len = 0;
+    str[len++] = '[';
+    for (ptrdiff_t i = 0; i < n; ++i) {
+      len += sprintf((char *)str + len, "%s\"%d\"", i ? "," : "", (int)(i % 1000));
+    }
+    str[len++] = ']';
+    struct json_string_source_ctx ssc = make_ss(str, len);
+    Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
+    const Json_View *v = json_parse(p);
+    if (!(json_type(v) == JSON_ARRAY)) return 1;
+    if (!(json_array_len(v) == n)) return 1;
+    ustring s = json_string(json_array_at(v, n - 1));
+    if (!(s.len == 3 && memcmp(s.s, "999", 3) == 0)) return 1;
+
+    // a capped parser reserves the same for the same input every time
+    json_parser_set_arena_high_water(p, INIT_ARENA_SIZE);
+    json_parser_reset(p);
+    ssc.cursor = 0;
+    json_parse(p);
+    ptrdiff_t reserved = json_parser_memory(p).reserved;
+    for (int i = 0; i < 3; ++i) {
+      json_parser_reset(p);
+      if (!(p->pool.next_size == 2*INIT_ARENA_SIZE)) return 1;
+      ssc.cursor = 0;
+      v = json_parse(p);
+      if (!(json_array_len(v) == n && json_parser_memory(p).reserved == reserved)) return 1;
+    }
+    fprintf(stdout, "test parse large array : SUCCESS\n");
+    destroy_parser(p);
+    free(str);
+    return 0;
+}
+
+static int test_arena_grow_in_place() {
+    unsigned char str[8192];
+    ptrdiff_t len = 0;
+    str[len++] = '[';
+    for (int i = 0; i < 1000; ++i) len += sprintf((char *)str + len, "%s%d", i ? "," : "", i);
+    str[len++] = ']';
+    struct json_string_source_ctx ssc = make_ss(str, len);
+    Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
+    const Json_View *v = json_parse(p);
+    if (!(json_type(v) == JSON_ARRAY && json_array_len(v) == 1000)) return 1;
+    // the array grew in place, nothing was left behind in the block
+    if (!((char *)v->value.vec.arr == p->pool.head->beg)) return 1;
+    if (!(p->pool.head->cur - p->pool.head->beg == align_size(1024*sizeof(Json_View)))) return 1;
+    fprintf(stdout, "test arena grow in place : SUCCESS\n");
+    destroy_parser(p);
+    return 0;
+}
+
+static int test_parse_exact_size() {
+    unsigned char * str = (unsigned char *)"[[], {\"a\": [1, \"x,]\", {}], \"b\": {\"c\": null}}, [true, false, 3]]";
+    struct json_string_source_ctx ssc = make_ss(str, strlen((char *)str));
+    Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
+    json_parser_set_exact_size(p, true);
+    const Json_View *v = json_parse(p);
+    if (!(json_type(v) == JSON_ARRAY)) return 1;
+    if (!(v->value.vec.len == 3 && v->value.vec.cap == 3)) return 1;
+    const Json_View *o = json_array_at(v, 1);
+    if (!(o->value.obj.len == 2 && o->value.obj.cap == 2)) return 1;
+    const Json_View *a = json_object_val(o, (ustring){.s = (unsigned char *)"a", .len = 1});
+    if (!(a->value.vec.len == 3 && a->value.vec.cap == 3)) return 1;
+    if (!(json_array_at(v, 2)->value.vec.cap == 3)) return 1;
+    fprintf(stdout, "test parse exact size : SUCCESS\n");
+    destroy_parser(p);
+    return 0;
+}
+
+static int test_parse_scratch_build() {
+    unsigned char * str = (unsigned char *)"{\"a\": [1, [2, 3], {\"x\": \"y\"}], \"b\": {\"c\": null, \"d\": []}}";
+    struct json_string_source_ctx ssc = make_ss(str, strlen((char *)str));
+    Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
+    json_parser_set_scratch_build(p, true);
+    const Json_View *v = json_parse(p);
+    if (!(json_type(v) == JSON_OBJECT)) return 1;
+    if (!(v->value.obj.len == 2 && v->value.obj.cap == 2)) return 1;
+    const Json_View *a = json_object_val(v, (ustring){.s = (unsigned char *)"a", .len = 1});
+    if (!(json_array_len(a) == 3 && a->value.vec.cap == 3)) return 1;
+    if (!(json_number(json_array_at(json_array_at(a, 1), 1)) == 3)) return 1;
+    const Json_View *y = json_object_val(json_array_at(a, 2), (ustring){.s = (unsigned char *)"x", .len = 1});
+    if (!(memcmp(json_string(y).s, "y", 1) == 0)) return 1;
+    const Json_View *b = json_object_val(v, (ustring){.s = (unsigned char *)"b", .len = 1});
+    if (!(b->value.obj.len == 2 && json_type(b->value.obj.vals + 1) == JSON_ARRAY)) return 1;
+    if (!(p->scratch.len == 0 && p->scratch.keys_len == 0)) return 1;
+    // array elements take no key slots
+    unsigned char *flat = (unsigned char *)"[[1, 2, 3], [4, [5]]]";
+    struct json_string_source_ctx ssc2 = make_ss(flat, strlen((char *)flat));
+    Json_Parser *p2 = make_parser(string_source_make(&ssc2), lib_allocator);
+    json_parser_set_scratch_build(p2, true);
+    v = json_parse(p2);
+    if (!(json_array_len(v) == 2 && json_array_len(json_array_at(v, 0)) == 3)) return 1;
+    if (!(p2->scratch.cap > 0 && p2->scratch.keys_cap == 0 && p2->scratch.keys == NULL)) return 1;
+    destroy_parser(p2);
+    fprintf(stdout, "test parse scratch build : SUCCESS\n");
+    destroy_parser(p);
+    return 0;
+}
+
+static int test_parse_deep_nesting() {
+    ptrdiff_t depth = 100000;
+    unsigned char *str = malloc(2*depth + 1);
+    memset(str, '[', depth);
+    memset(str + depth, ']', depth);
+    str[2*depth] = '\0';
+    struct json_string_source_ctx ssc = make_ss(str, 2*depth);
+    Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
+    json_parser_set_scratch_build(p, true);
+    const Json_View *v = json_parse(p);
+    if (!(json_type(v) == JSON_ARRAY && json_array_len(v) == 1)) return 1;
+
+    // writing it back doesn't recurse either, only the fixed buffer version
+    // has a depth limit
+    ustring out = json_serialize_alloc(v, JSON_WRITE_COMPACT, lib_allocator);
+    if (!(out.len == 2*depth && memcmp(out.s, str, out.len) == 0)) return 1;
+    free(out.s);
+    unsigned char small[16];
+    if (!(json_serialize(v, JSON_WRITE_COMPACT, small, sizeof(small)) == -1)) return 1;
+
+    const Json_View *copy = json_clone(v, lib_allocator);
+    out = json_serialize_alloc(copy, JSON_WRITE_COMPACT, lib_allocator);
+    if (!(out.len == 2*depth && memcmp(out.s, str, out.len) == 0)) return 1;
+    free(out.s);
+    json_clone_free(copy);
+
+    if (!json_parser_compact(p)) return 1;
+    out = json_serialize_alloc(v, JSON_WRITE_COMPACT, lib_allocator);
+    if (!(out.len == 2*depth && memcmp(out.s, str, out.len) == 0)) return 1;
+    free(out.s);
+
+    // unclosed arrays fail cleanly instead of overflowing the C stack
+    str[depth] = '\0';
+    ssc = make_ss(str, depth);
+    json_parser_reset(p);
+    v = json_parse(p);
+    if (!(json_type(v) == JSON_ERROR && v->value.err_code == JSON_ERR_INVALID_END)) return 1;
+
+    str[depth] = ']';
+    ssc = make_ss(str, 2*depth);
+    json_parser_reset(p);
+    json_parser_set_max_depth(p, 200);
+    v = json_parse(p);
+    if (!(json_type(v) == JSON_ERROR && v->value.err_code == JSON_ERR_MAX_DEPTH)) return 1;
+    fprintf(stdout, "test parse deep nesting : SUCCESS\n");
+    destroy_parser(p);
+    free(str);
+    return 0;
+}
+
+static int test_serialize() {
+    unsigned char * str = (unsigned char *)"{\"a\": [1, 0.5, -25, 1.25e2],"
+      " \"s\": \"q\\\"b\\\\n\\n\\u0001/é long enough to scan\", \"e\": {}, \"f\": [], \"t\": [true, false, null]}";
+    struct json_string_source_ctx ssc = make_ss(str, strlen((char *)str));
+    Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
+    const Json_View *v = json_parse(p);
+    if (!(json_type(v) == JSON_OBJECT)) return 1;
+
+    const char *compact = "{\"a\":[1,0.5,-25,125],"
+      "\"s\":\"q\\\"b\\\\n\\n\\u0001/é long enough to scan\",\"e\":{},\"f\":[],\"t\":[true,false,null]}";
+    ustring out = json_serialize_alloc(v, JSON_WRITE_COMPACT, lib_allocator);
+    if (!(out.s && out.len == (ptrdiff_t)strlen(compact) && memcmp(out.s, compact, out.len) == 0)) return 1;
+
+    // output that doesn't fit is truncated but the full length is reported
+    unsigned char small[8];
+    if (!(json_serialize(v, JSON_WRITE_COMPACT, small, sizeof(small)) == out.len)) return 1;
+    if (!(memcmp(small, compact, 7) == 0 && small[7] == '\0')) return 1;
+    free(out.s);
+
+    // pretty output parses back to the same compact form
+    ustring pretty = json_serialize_alloc(v, JSON_WRITE_PRETTY, lib_allocator);
+    struct json_string_source_ctx ssc2 = make_ss(pretty.s, pretty.len);
+    Json_Parser *p2 = make_parser(string_source_make(&ssc2), lib_allocator);
+    const Json_View *v2 = json_parse(p2);
+    unsigned char buf[512];
+    ptrdiff_t len = json_serialize(v2, JSON_WRITE_COMPACT, buf, sizeof(buf));
+    if (!(len == (ptrdiff_t)strlen(compact) && memcmp(buf, compact, len) == 0)) return 1;
+
+    char num[32];
+    double nums[] = {-0.1, 1e300, 12345678901234567890.0, 0.1 + 0.2, 2.5e-300, 1e-5,
+                     DBL_MAX, 1234567890123456.5};
+    const char *expect[] = {"-0.1", "1e+300", "1.2345678901234567e+19", "0.30000000000000004",
+                            "2.5e-300", "1e-05", "1.7976931348623157e+308",
+                            "1234567890123456.5"};
+    for (size_t i = 0; i < ARRAY_LEN(nums); ++i) {
+      format_number(nums[i], num);
+      if (!(strcmp(num, expect[i]) == 0)) return 1;
+    }
+    // a locale with a decimal comma doesn't leak into the output
+    if (setlocale(LC_NUMERIC, "de_DE.UTF-8") != NULL) {
+      unsigned char num[32];
+      struct json_ast_node half = make_json_number(1.5);
+      json_serialize(&half, JSON_WRITE_COMPACT, num, sizeof(num));
+      setlocale(LC_NUMERIC, "C");
+      if (!(strcmp((char *)num, "1.5") == 0)) return 1;
+    }
+    fprintf(stdout, "test serialize : SUCCESS\n");
+    free(pretty.s);
+    destroy_parser(p2);
+    destroy_parser(p);
+    return 0;
+}
+
+struct mem_sink {
+  unsigned char buf[1024];
+  ptrdiff_t len;
+  int writes;
+};
+
+static bool
+mem_sink_write(const unsigned char *buf, ptrdiff_t len, void *ctx)
+{
+  struct mem_sink *m = ctx;
+  memcpy(m->buf + m->len, buf, len);
+  m->len += len;
+  ++m->writes;
+  return true;
+}
+
+static int test_writer() {
+    struct mem_sink m = {0};
+    Json_Writer *w = make_writer((struct json_sink){ .write = mem_sink_write, .ctx = &m }, lib_allocator, JSON_WRITE_COMPACT);
+    json_write_begin_object(w);
+    json_write_key(w, (ustring){ .s = (unsigned char *)"id", .len = 2 });
+    json_write_int(w, 42);
+    json_write_key(w, (ustring){ .s = (unsigned char *)"tags", .len = 4 });
+    json_write_begin_array(w);
+    json_write_string(w, (ustring){ .s = (unsigned char *)"a\"b", .len = 3 });
+    json_write_number(w, 0.5);
+    json_write_bool(w, true);
+    json_write_null(w);
+    json_write_end_array(w);
+    json_write_end_object(w);
+    json_write_begin_array(w);
+    json_write_end_array(w);
+    // nothing reaches the sink before the buffer fills or is flushed
+    if (!(m.writes == 0)) return 1;
+    if (!destroy_writer(w)) return 1;
+    const char *expect = "{\"id\":42,\"tags\":[\"a\\\"b\",0.5,true,null]}\n[]";
+    if (!(m.len == (ptrdiff_t)strlen(expect) && memcmp(m.buf, expect, m.len) == 0)) return 1;
+
+    // calls that would make the output malformed are refused
+    m.len = 0;
+    w = make_writer((struct json_sink){ .write = mem_sink_write, .ctx = &m }, lib_allocator, JSON_WRITE_COMPACT);
+    json_write_begin_object(w);
+    if (!(json_write_null(w) == false)) return 1;
+    if (!(destroy_writer(w) == false)) return 1;
+
+    FILE *f = tmpfile();
+    w = make_writer(json_file_sink(f), lib_allocator, JSON_WRITE_PRETTY);
+    json_write_begin_array(w);
+    json_write_int(w, 1);
+    json_write_begin_object(w);
+    json_write_end_object(w);
+    json_write_end_array(w);
+    if (!destroy_writer(w)) return 1;
+    char buf[64] = {0};
+    rewind(f);
+    fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    if (!(strcmp(buf, "[\n  1,\n  {}\n]") == 0)) return 1;
+    fprintf(stdout, "test writer : SUCCESS\n");
+    return 0;
+}
+
+static int test_builder() {
+    unsigned char * str = (unsigned char *)"{\"a\": 1, \"b\": [true]}";
+    struct json_string_source_ctx ssc = make_ss(str, strlen((char *)str));
+    Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
+    json_parse(p);
+    Json_View *root = json_parser_root(p);
+    ustring a = { .s = (unsigned char *)"a", .len = 1 };
+    ustring b = { .s = (unsigned char *)"b", .len = 1 };
+    ustring c = { .s = (unsigned char *)"c", .len = 1 };
+
+    json_object_set(p, root, a, json_new_string(p, (ustring){ .s = (unsigned char *)"x", .len = 1 }));
+    Json_View *arr = json_mut(json_object_val(root, b));
+    json_array_push(p, arr, json_new_number(p, 2));
+    Json_View *obj = json_object_set(p, root, c, json_new_object(p));
+    json_object_set(p, obj, a, json_new_null(p));
+    json_replace(json_mut(json_array_at(arr, 0)), json_new_bool(p, false));
+
+    unsigned char buf[128];
+    const char *expect = "{\"a\":\"x\",\"b\":[false,2],\"c\":{\"a\":null}}";
+    ptrdiff_t len = json_serialize(root, JSON_WRITE_COMPACT, buf, sizeof(buf));
+    if (!(len == (ptrdiff_t)strlen(expect) && memcmp(buf, expect, len) == 0)) return 1;
+    fprintf(stdout, "test builder : SUCCESS\n");
+    destroy_parser(p);
+    return 0;
+}
+
+struct test_address {
+  ustring city;
+  int64_t zip;
+};
+
+struct test_user {
+  int64_t id;
+  ustring name;
+  double score;
+  bool active;
+  struct test_address address;
+  const Json_View *extra;
+};
+
+static const struct json_field test_address_fields[] = {
+  { "city", JSON_FIELD_STRING, offsetof(struct test_address, city), true, NULL },
+  { "zip", JSON_FIELD_INT, offsetof(struct test_address, zip), false, NULL },
+};
+static const struct json_struct_desc test_address_desc = { test_address_fields, ARRAY_LEN(test_address_fields), NULL };
+
+static const struct json_field test_user_fields[] = {
+  { "id", JSON_FIELD_INT, offsetof(struct test_user, id), true, NULL },
+  { "name", JSON_FIELD_STRING, offsetof(struct test_user, name), true, NULL },
+  { "score", JSON_FIELD_DOUBLE, offsetof(struct test_user, score), false, NULL },
+  { "active", JSON_FIELD_BOOL, offsetof(struct test_user, active), false, NULL },
+  { "address", JSON_FIELD_OBJECT, offsetof(struct test_user, address), false, &test_address_desc },
+  { "extra", JSON_FIELD_VIEW, offsetof(struct test_user, extra), false, NULL },
+};
+static const struct json_struct_desc test_user_desc = { test_user_fields, ARRAY_LEN(test_user_fields), NULL };
+
+static int test_decode() {
+    unsigned char * str = (unsigned char *)"{\"name\": \"bob\", \"skip\": {\"a\": [\"]}\", {}], \"b\": 1},"
+      " \"id\": 7, \"score\": 2.5, \"address\": {\"zip\": 12345, \"city\": \"x\"}, \"tags\": [1, 2],"
+      " \"active\": true, \"extra\": [null], \"nothing\": null}";
+    struct json_string_source_ctx ssc = make_ss(str, strlen((char *)str));
+    Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
+    struct test_user u = {0};
+    if (!json_decode(p, &test_user_desc, &u)) return 1;
+    if (!(u.id == 7 && u.score == 2.5 && u.active)) return 1;
+    if (!(u.name.len == 3 && memcmp(u.name.s, "bob", 3) == 0)) return 1;
+    if (!(u.address.zip == 12345 && u.address.city.len == 1)) return 1;
+    if (!(json_type(u.extra) == JSON_ARRAY && json_array_len(u.extra) == 1)) return 1;
+    if (!(json_parser_error(p) == NULL)) return 1;
+
+    // type mismatches and missing fields are errors
+    const char *bad[] = { "{\"id\": \"7\", \"name\": \"a\"}", "{\"id\": 1.5, \"name\": \"a\"}",
+                          "{\"id\": 7}", "{\"id\": 7, \"name\": \"a\", \"address\": {\"zip\": 1}}", "[]" };
+    for (size_t i = 0; i < ARRAY_LEN(bad); ++i) {
+      ssc = make_ss((unsigned char *)bad[i], strlen(bad[i]));
+      json_parser_reset(p);
+      if (!(json_decode(p, &test_user_desc, &u) == false && json_parser_error(p) != NULL)) return 1;
+    }
+
+    // descriptions past the seen bitmask are refused, not silently unmatched
+    struct json_struct_desc wide = test_user_desc;
+    wide.len = JSON_DECODE_MAX_FIELDS + 1;
+    ssc = make_ss(str, strlen((char *)str));
+    json_parser_reset(p);
+    if (!(json_decode(p, &wide, &u) == false)) return 1;
+    if (!(strcmp(json_parser_error(p), err_lookup_table[JSON_ERR_TOO_MANY_FIELDS]) == 0)) return 1;
+
+    // running out of input is not a type mismatch
+    const char *empty[] = { "", " \n " };
+    for (size_t i = 0; i < ARRAY_LEN(empty); ++i) {
+      ssc = make_ss((unsigned char *)empty[i], strlen(empty[i]));
+      json_parser_reset(p);
+      if (!(json_decode(p, &test_user_desc, &u) == false)) return 1;
+      if (!(strcmp(json_parser_error(p), err_lookup_table[JSON_ERR_INVALID_END]) == 0)) return 1;
+    }
+
+    // integer fields hold every int64_t exactly and reject the rest
+    struct { const char *str; int64_t id; } ints[] = {
+      { "{\"id\": 3000000000, \"name\": \"a\"}", 3000000000 },
+      { "{\"id\": 12345678901234, \"name\": \"a\"}", 12345678901234 },
+      { "{\"id\": 9223372036854775807, \"name\": \"a\"}", INT64_MAX },
+      { "{\"id\": -9223372036854775808, \"name\": \"a\"}", INT64_MIN },
+      { "{\"id\": -0, \"name\": \"a\"}", 0 },
+    };
+    for (size_t i = 0; i < ARRAY_LEN(ints); ++i) {
+      ssc = make_ss((unsigned char *)ints[i].str, strlen(ints[i].str));
+      json_parser_reset(p);
+      if (!(json_decode(p, &test_user_desc, &u) && u.id == ints[i].id)) return 1;
+    }
+    const char *out_of_range[] = { "{\"id\": 9223372036854775808, \"name\": \"a\"}",
+                                   "{\"id\": -9223372036854775809, \"name\": \"a\"}",
+                                   "{\"id\": 1e300, \"name\": \"a\"}", "{\"id\": 1.0, \"name\": \"a\"}" };
+    for (size_t i = 0; i < ARRAY_LEN(out_of_range); ++i) {
+      ssc = make_ss((unsigned char *)out_of_range[i], strlen(out_of_range[i]));
+      json_parser_reset(p);
+      if (!(json_decode(p, &test_user_desc, &u) == false)) return 1;
+      if (!(strcmp(json_parser_error(p), err_lookup_table[JSON_ERR_TYPE_MISMATCH]) == 0)) return 1;
+    }
+    fprintf(stdout, "test decode : SUCCESS\n");
+    destroy_parser(p);
+    return 0;
+}
+
+static int test_error_position() {
+    unsigned char * str = (unsigned char *)"[1,\n  {\"a\": \"x\"},\n  tru]";
+    struct json_string_source_ctx ssc = make_ss(str, strlen((char *)str));
+    Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
+    const Json_View *v = json_parse(p);
+    if (!(json_type(v) == JSON_ERROR)) return 1;
+    if (!(json_parser_linenum(p) == 2 && json_parser_position(p) == 5)) return 1;
+    fprintf(stdout, "test error position : SUCCESS\n");
+    destroy_parser(p);
+    return 0;
+}
+
+static int test_stats() {
+    unsigned char * str = (unsigned char *)"{\"a\": [1, 2.5, \"xy\", true, null, [[]]]}";
+    struct json_string_source_ctx ssc = make_ss(str, strlen((char *)str));
+    Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
+    json_parse(p);
+    struct json_stats st;
+#ifdef JP_STATS
+    if (!json_parser_stats(p, &st)) return 1;
+    if (!(st.bytes == (ptrdiff_t)strlen((char *)str) && st.string_appends == 3 && st.peak_depth == 4)) return 1;
+    if (!(st.transitions[JSON_STATS_LITERAL] > 0 && st.transitions[JSON_STATS_STRING] > 0
+          && st.transitions[JSON_STATS_NUMBER] > 0 && st.arena_blocks == 1)) return 1;
+    json_parser_reset(p);
+    json_parser_stats(p, &st);
+    if (!(st.bytes == 0 && st.peak_depth == 0)) return 1;
+#else
+    if (!(json_parser_stats(p, &st) == false && st.bytes == 0)) return 1;
+#endif
+    fprintf(stdout, "test stats : SUCCESS\n");
+    destroy_parser(p);
+    return 0;
+}
+
+static int test_parser_memory() {
+    // strings between the growths of the array make it move
+    unsigned char str[4096] = "[";
+    for (int i = 0; i < 200; ++i) strcat((char *)str, i ? ",\"ab\"" : "\"ab\"");
+    strcat((char *)str, "]");
+    struct json_string_source_ctx ssc = make_ss(str, strlen((char *)str));
+    Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
+    struct json_memory m = json_parser_memory(p);
+    if (!(m.reserved == INIT_ARENA_SIZE && m.used == 0 && m.abandoned == 0 && m.peak == m.reserved)) return 1;
+    json_parse(p);
+    m = json_parser_memory(p);
+    if (!(m.abandoned > 0 && m.used >= 200 * (ptrdiff_t)sizeof(struct json_ast_node))) return 1;
+    if (!(m.used + m.abandoned <= m.reserved && m.peak == m.reserved)) return 1;
+    json_parser_reset(p);
+    m = json_parser_memory(p);
+    if (!(m.used == 0 && m.abandoned == 0 && m.reserved == INIT_ARENA_SIZE)) return 1;
+    fprintf(stdout, "test parser memory : SUCCESS\n");
+    destroy_parser(p);
+    return 0;
+}
+
+static void *
+count_blocks_malloc(ptrdiff_t sz, void *ctx)
+{
+  ++*(ptrdiff_t *)ctx;
+  return malloc(sz);
+}
+
+static void
+count_blocks_free(void *ptr, void *ctx)
+{
+  if (ptr) --*(ptrdiff_t *)ctx;
+  free(ptr);
+}
+
+#ifndef __STDC_NO_THREADS__
+static int
+cache_one_block(void *arg)
+{
+  struct json_allocator *al = arg;
+  unsigned char str[] = "[]";
+  struct json_string_source_ctx ssc = make_ss(str, 2);
+  json_block_cache_set_cap(4 * INIT_ARENA_SIZE);
+  destroy_parser(make_parser(string_source_make(&ssc), *al));
+  return block_cache.bytes > 0;
+}
+#endif
+
+static int test_block_cache() {
+    unsigned char * str = (unsigned char *)"[1, 2]";
+    struct json_string_source_ctx ssc = make_ss(str, strlen((char *)str));
+    json_block_cache_set_cap(4 * INIT_ARENA_SIZE);
+    Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
+    Arena *block = p->pool.head;
+    destroy_parser(p);
+
+    // a parser with another allocator can't take the block
+    struct json_allocator other = lib_allocator;
+    other.ctx = &other;
+    p = make_parser(string_source_make(&ssc), other);
+    if (!(p->pool.head != block)) return 1;
+    destroy_parser(p);
+
+    p = make_parser(string_source_make(&ssc), lib_allocator);
+    if (!(p->pool.head == block)) return 1;
+    const Json_View *v = json_parse(p);
+    if (!(json_type(v) == JSON_ARRAY && json_array_len(v) == 2)) return 1;
+    destroy_parser(p);
+
+    json_block_cache_flush();
+    p = make_parser(string_source_make(&ssc), lib_allocator);
+    destroy_parser(p);
+    json_block_cache_set_cap(0);
+
+    // blocks past the cap go back to the allocator, lowering it frees the rest
+    ptrdiff_t live = 0;
+    struct json_allocator counted = { .al_malloc = count_blocks_malloc, .al_free = count_blocks_free, .ctx = &live };
+    Json_Parser *ps[6];
+    for (size_t i = 0; i < ARRAY_LEN(ps); ++i) ps[i] = make_parser(string_source_make(&ssc), counted);
+    ptrdiff_t parsers = live;
+    json_block_cache_set_cap(4 * INIT_ARENA_SIZE);
+    for (size_t i = 0; i < ARRAY_LEN(ps); ++i) destroy_parser(ps[i]);
+    if (!(block_cache.bytes > 0 && block_cache.bytes <= 4 * INIT_ARENA_SIZE)) return 1;
+    ptrdiff_t cached = 0;
+    for (Arena *a = block_cache.head; a; a = a->next) ++cached;
+    if (!(cached < (ptrdiff_t)ARRAY_LEN(ps) && live == cached && parsers > live)) return 1;
+    json_block_cache_set_cap(INIT_ARENA_SIZE);
+    if (!(block_cache.bytes <= INIT_ARENA_SIZE && live < cached)) return 1;
+    json_block_cache_set_cap(0);
+    if (!(block_cache.bytes == 0 && block_cache.head == NULL && live == 0)) return 1;
+
+#ifndef __STDC_NO_THREADS__
+    // a thread that exits with blocks in its cache gives them back
+    thrd_t t;
+    int cached_in_thread = 0;
+    if (!(thrd_create(&t, cache_one_block, &counted) == thrd_success)) return 1;
+    thrd_join(t, &cached_in_thread);
+    if (!(cached_in_thread && live == 0)) return 1;
+#endif
+    fprintf(stdout, "test block cache : SUCCESS\n");
+    return 0;
+}
+
+static int test_clone() {
+    unsigned char * str = (unsigned char *)"{\"data\": [1, 2, 3], \"user\": {\"name\": \"bob\", \"tags\": [\"a\", {}, []], \"id\": 7}}";
+    struct json_string_source_ctx ssc = make_ss(str, strlen((char *)str));
+    Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
+    const Json_View *v = json_parse(p);
+    const Json_View *user = json_clone(json_object_val(v, (ustring){.s = (unsigned char *)"user", .len = 4}), lib_allocator);
+    if (!(user != NULL)) return 1;
+    destroy_parser(p);
+
+    unsigned char out[128];
+    const char *expect = "{\"name\":\"bob\",\"tags\":[\"a\",{},[]],\"id\":7}";
+    if (!(json_serialize(user, JSON_WRITE_COMPACT, out, sizeof(out)) == (ptrdiff_t)strlen(expect))) return 1;
+    if (!(strcmp((char *)out, expect) == 0)) return 1;
+    // children follow their parent in the block
+    const Json_View *tags = json_object_val(user, (ustring){.s = (unsigned char *)"tags", .len = 4});
+    if (!((const char *)tags > (const char *)user && (const char *)json_array_at(tags, 0) > (const char *)tags)) return 1;
+
+    // a missing key clones to nothing
+    if (!(json_clone(json_object_val(user, (ustring){.s = (unsigned char *)"x", .len = 1}), lib_allocator) == NULL)) return 1;
+    json_clone_free(NULL);
+    json_clone_free(user);
+    fprintf(stdout, "test clone : SUCCESS\n");
+    return 0;
+}
+
+static int test_parser_compact() {
+    // strings between the growths of the arrays leave holes behind them
+    unsigned char str[4096] = "{\"a\": [";
+    for (int i = 0; i < 100; ++i) strcat((char *)str, i ? ",\"ab\"" : "\"ab\"");
+    strcat((char *)str, "], \"b\": {\"c\": [true, null, 1.5]}}");
+    struct json_string_source_ctx ssc = make_ss(str, strlen((char *)str));
+    Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
+    const Json_View *v = json_parse(p);
+    unsigned char before[4096], after[4096];
+    ptrdiff_t len = json_serialize(v, JSON_WRITE_COMPACT, before, sizeof(before));
+    struct json_memory m = json_parser_memory(p);
+    if (!(m.abandoned > 0)) return 1;
+
+    if (!json_parser_compact(p)) return 1;
+    struct json_memory c = json_parser_memory(p);
+    if (!(c.abandoned == 0 && c.used == c.reserved && c.used < m.used)) return 1;
+    if (!(json_serialize(v, JSON_WRITE_COMPACT, after, sizeof(after)) == len)) return 1;
+    if (!(memcmp(before, after, len) == 0)) return 1;
+
+    // the compacted block is reused by the next parse
+    json_parser_reset(p);
+    ssc = make_ss((unsigned char *)"[1]", 3);
+    v = json_parse(p);
+    if (!(json_type(v) == JSON_ARRAY && json_number(json_array_at(v, 0)) == 1)) return 1;
+    fprintf(stdout, "test parser compact : SUCCESS\n");
+    destroy_parser(p);
+    return 0;
+}
+
+static int test_adaptive_size() {
+    // strings between the growths of the array make it move
+    unsigned char str[4096] = "{\"a\": [";
+    for (int i = 0; i < 100; ++i) strcat((char *)str, i ? ",\"ab\"" : "\"ab\"");
+    strcat((char *)str, "], \"b\": [1, 2, 3], \"c\": {}}");
+    struct json_string_source_ctx ssc = make_ss(str, strlen((char *)str));
+    Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
+    json_parser_set_adaptive_size(p, true);
+    const Json_View *v = json_parse(p);
+    if (!(json_parser_memory(p).abandoned > 0)) return 1;
+
+    for (int i = 0; i < 3; ++i) {
+      json_parser_reset(p);
+      ssc = make_ss(str, strlen((char *)str));
+      v = json_parse(p);
+      if (!(json_type(v) == JSON_OBJECT && json_parser_memory(p).abandoned == 0)) return 1;
+    }
+    if (!(v->value.obj.cap == 3 && v->value.obj.vals[0].value.vec.cap == 100)) return 1;
+    // nothing came after these, so they hold no slack
+    const Json_View *b = json_object_val(v, (ustring){.s = (unsigned char *)"b", .len = 1});
+    if (!(b->value.vec.len == 3 && b->value.vec.cap == 3)) return 1;
+    fprintf(stdout, "test adaptive size : SUCCESS\n");
+    destroy_parser(p);
+    return 0;
+}
+
+static int test_projection() {
+    unsigned char * str = (unsigned char *)"{\"id\": 7, \"skip\": {\"deep\": [1, {\"x\": \"]}\\\"\"}]}, "
+        "\"user\": {\"name\": \"bob\", \"age\": 30}, \"name\": 1, "
+        "\"items\": [{\"price\": 1.5, \"sku\": \"a\"}, {\"sku\": \"b\"}, 3], \"tags\": [\"x\"]}";
+    struct json_string_source_ctx ssc = make_ss(str, strlen((char *)str));
+    Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
+    const char *paths[] = { "/id", "/user/name", "/items/*/price", "/tags" };
+    if (!json_parser_set_projection(p, paths, ARRAY_LEN(paths))) return 1;
+    const Json_View *v = json_parse(p);
+    unsigned char out[256];
+    const char *expect = "{\"id\":7,\"user\":{\"name\":\"bob\"},\"items\":[{\"price\":1.5},{}],\"tags\":[\"x\"]}";
+    if (!(json_serialize(v, JSON_WRITE_COMPACT, out, sizeof(out)) == (ptrdiff_t)strlen(expect))) return 1;
+    if (!(strcmp((char *)out, expect) == 0)) return 1;
+
+    // paths start with / or keep everything
+    const char *bad_paths[] = { "id" };
+    if (!(json_parser_set_projection(p, bad_paths, 1) == false)) return 1;
+    // containers skipped over don't shift the exact sizes of later ones
+    unsigned char *sized = (unsigned char *)"{\"skip\": [[1, 2, 3, 4, 5, 6, 7, 8, 9, 10], [1], [1]],"
+      " \"keep\": [1], \"k2\": [1, 2]}";
+    ssc = make_ss(sized, strlen((char *)sized));
+    const char *keep[] = { "/keep", "/k2" };
+    if (!json_parser_set_projection(p, keep, ARRAY_LEN(keep))) return 1;
+    json_parser_set_exact_size(p, true);
+    json_parser_reset(p);
+    v = json_parse(p);
+    if (!(json_type(v) == JSON_OBJECT && v->value.obj.len == 2)) return 1;
+    if (!(v->value.obj.vals[0].value.vec.cap == 1 && v->value.obj.vals[1].value.vec.cap == 2)) return 1;
+    // filtered containers reserve at most what the paths can keep
+    unsigned char wide[512] = "{\"list\": [{\"a\": 1, \"b\": 2}, {\"a\": 3}, {}]";
+    for (int i = 0; i < 40; ++i) {
+      snprintf((char *)wide + strlen((char *)wide), 16, ", \"m%d\": %d", i, i);
+    }
+    strcat((char *)wide, "}");
+    ssc = make_ss(wide, strlen((char *)wide));
+    const char *two[] = { "/m3", "/list/*/a" };
+    if (!json_parser_set_projection(p, two, ARRAY_LEN(two))) return 1;
+    json_parser_reset(p);
+    v = json_parse(p);
+    if (!(json_type(v) == JSON_OBJECT && v->value.obj.len == 2 && v->value.obj.cap == 2)) return 1;
+    const Json_View *list = json_object_val(v, (ustring){(unsigned char *)"list", 4});
+    if (!(json_array_len(list) == 3 && list->value.vec.cap == 3)) return 1;
+    if (!(list->value.vec.arr[0].value.obj.len == 1 && list->value.vec.arr[0].value.obj.cap == 1)) return 1;
+    json_parser_set_exact_size(p, false);
+
+    const char *all[] = { "" };
+    if (!json_parser_set_projection(p, all, 1)) return 1;
+    json_parser_reset(p);
+    ssc = make_ss(str, strlen((char *)str));
+    v = json_parse(p);
+    if (!(json_type(v) == JSON_OBJECT && v->value.obj.len == 6)) return 1;
+    fprintf(stdout, "test projection : SUCCESS\n");
+    destroy_parser(p);
+    return 0;
+}
+
+#include "sample_user_schema.h"
+
+static int sample_user_matches;
+
+static ptrdiff_t
+count_sample_user_match(const unsigned char *key, ptrdiff_t len)
+{
+  ++sample_user_matches;
+  return sample_user_match(key, len);
+}
+
+static int test_generated_decode() {
+    unsigned char * str = (unsigned char *)"{\"user_id\": \"583c3ac3f38e84297c002546\", \"email\": \"test@test.com\","
+      " \"given_name\": \"Hello\", \"last_ip\": \"94.121.163.63\", \"logins_count\": 15,"
+      " \"last_login\": \"2016-12-02T01:17:29.310Z\", \"unknown\": [1], \"email_verified\": true}";
+    struct json_string_source_ctx ssc = make_ss(str, strlen((char *)str));
+    Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
+    struct sample_user u = {0};
+    if (!decode_sample_user(p, &u)) return 1;
+    if (!(u.logins_count == 15 && u.email_verified && u.nickname.s == NULL)) return 1;
+    if (!(u.given_name.len == 5 && memcmp(u.given_name.s, "Hello", 5) == 0)) return 1;
+    if (!(u.last_ip.len == 13 && u.last_login.len == 24)) return 1;
+    if (!(sample_user_match((const unsigned char *)"user_ix", 7) == -1)) return 1;
+
+    const char *missing = "{\"user_id\": \"a\"}";
+    ssc = make_ss((unsigned char *)missing, strlen(missing));
+    json_parser_reset(p);
+    if (!(decode_sample_user(p, &u) == false && json_parser_error(p) != NULL)) return 1;
+
+    // keys in declaration order never reach the matcher
+    const char *ordered = "{\"user_id\": \"a\", \"email\": \"b\", \"name\": \"c\", \"given_name\": \"d\","
+      " \"family_name\": \"e\", \"nickname\": \"f\", \"last_ip\": \"g\", \"logins_count\": 1,"
+      " \"created_at\": \"h\", \"updated_at\": \"i\", \"last_login\": \"j\", \"email_verified\": false}";
+    struct json_struct_desc counted = sample_user_desc;
+    counted.match = count_sample_user_match;
+    ssc = make_ss((unsigned char *)ordered, strlen(ordered));
+    json_parser_reset(p);
+    if (!(json_decode(p, &counted, &u) && sample_user_matches == 0 && u.logins_count == 1)) return 1;
+    ssc = make_ss(str, strlen((char *)str));
+    json_parser_reset(p);
+    if (!(json_decode(p, &counted, &u) && sample_user_matches > 0)) return 1;
+    fprintf(stdout, "test generated decode : SUCCESS\n");
+    destroy_parser(p);
+    return 0;
+}
+
+#ifdef PERF_TEST
+
+
+struct json_file_ctx {
+  FILE *f;
+  int c;
+};
+
+static void
+file_next_byte(void *ctx)
+{
+  struct json_file_ctx *ss = ctx;
+  int val = fgetc(ss->f);
+  if (val != EOF) {
+    ss->c = val;
+  }
+}
+
+static unsigned char
+file_get_byte(void *ctx)
+{
+  struct json_file_ctx *ss = ctx;
+  return (unsigned char)ss->c;
+}
+
+static bool
+file_has_next_byte(void *ctx)
+{
+  struct json_file_ctx *ss = ctx;
+  return (ss->c == EOF);
+}
+
+static void
+file_rewind(void *ctx)
+{
+  struct json_file_ctx *ss = ctx;
+  rewind(ss->f);
+  ss->c = fgetc(ss->f);
+}
+
+struct json_source file_source_make(char *fname, struct json_file_ctx *ctx) {
+  ctx->f = fopen(fname, "r");
+  ctx->c = fgetc(ctx->f);
+  return (struct json_source) {
+    .next = file_next_byte,
+    .get_byte = file_get_byte,
+    .has_next = file_has_next_byte,
+    .ctx = (void*)ctx,
+    .rewind = file_rewind,
+  };
+}
+
+char *read_entire_file(const char *filename, ptrdiff_t *out_len) {
+    // Open the file for reading
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        perror("File opening failed");
+        return NULL;
+    }
+
+    // Move the file pointer to the end of the file to determine its size
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    if (file_size == -1) {
+        perror("Failed to determine file size");
+        fclose(file);
+        return NULL;
+    }
+
+    // Move the file pointer back to the beginning of the file
+    fseek(file, 0, SEEK_SET);
+
+    // Allocate memory to store the file content
+    char *buffer = (char *)malloc(file_size + 1);  // +1 for the null terminator
+    if (!buffer) {
+        perror("Memory allocation failed");
+        fclose(file);
+        return NULL;
+    }
+
+    // Read the file content into the buffer
+    size_t bytes_read = fread(buffer, 1, file_size, file);
+    if (bytes_read != file_size) {
+        perror("Failed to read entire file");
+        free(buffer);
+        fclose(file);
+        return NULL;
+    }
+
+    // Null-terminate the string
+    buffer[file_size] = '\0';
+
+    // Set the output length
+    if (out_len) {
+        *out_len = file_size;
+    }
+
+    // Close the file and return the buffer
+    fclose(file);
+    return buffer;
+}
+
+#include <time.h>
+
+#define BENCH_US(str) (ustring){ .s = (unsigned char *)(str), .len = sizeof(str) - 1 }
+
+// Growable memory sink the corpora are written into.
+struct bench_buf {
+  unsigned char *buf;
+  ptrdiff_t len;
+  ptrdiff_t cap;
+};
+
+static bool
+bench_buf_write(const unsigned char *buf, ptrdiff_t len, void *ctx)
+{
+  struct bench_buf *b = ctx;
+  if (b->len + len + 1 > b->cap) {
+    ptrdiff_t cap = b->cap ? b->cap : 1 << 20;
+    while (b->len + len + 1 > cap) cap *= 2;
+    unsigned char *tmp = realloc(b->buf, cap);
+    if (tmp == NULL) return false;
+    b->buf = tmp;
+    b->cap = cap;
+  }
+  memcpy(b->buf + b->len, buf, len);
+  b->len += len;
+  // the string source reads one byte past the end
+  b->buf[b->len] = '\0';
+  return true;
+}
+
+static void
+build_strings(Json_Writer *w, const struct bench_buf *b, ptrdiff_t size)
+{
+  static const char text[] = "The quick brown fox \"jumps\" over the lazy dog.\n"
+    "Caf\xc3\xa9 na\xc3\xafve \\ r\xc3\xa9sum\xc3\xa9 \xe2\x82\xac 100 \xf0\x9f\x98\x80 lorem ipsum dolor sit amet";
+  json_write_begin_array(w);
+  for (ptrdiff_t i = 0; b->len < size; ++i) {
+    ptrdiff_t len = 8 + (i * 37) % (sizeof(text) - 9);
+    // don't cut a multi byte sequence in half
+    while ((text[len] & 0xC0) == 0x80) --len;
+    json_write_string(w, (ustring){ .s = (unsigned char *)text, .len = len });
+  }
+  json_write_end_array(w);
+}
+
+static void
+build_numbers(Json_Writer *w, const struct bench_buf *b, ptrdiff_t size)
+{
+  json_write_begin_array(w);
+  for (long long i = 0; b->len < size; ++i) {
+    switch (i % 3) {
+    case 0: json_write_int(w, i * 7919 - 1000000); break;
+    case 1: json_write_number(w, (double)i / 64); break;
+    case 2: json_write_number(w, (double)(i % 1000) * 1.5e-12); break;
+    }
+  }
+  json_write_end_array(w);
+}
+
+static void
+build_nested(Json_Writer *w, const struct bench_buf *b, ptrdiff_t size)
+{
+  enum { DEPTH = 64 };
+  json_write_begin_array(w);
+  for (long long i = 0; b->len < size; ++i) {
+    for (int d = 0; d < DEPTH; ++d) {
+      if (d % 2 == 0) {
+        json_write_begin_object(w);
+        json_write_key(w, BENCH_US("a"));
+      } else {
+        json_write_begin_array(w);
+      }
+    }
+    json_write_int(w, i);
+    for (int d = DEPTH - 1; d >= 0; --d) {
+      if (d % 2 == 0) json_write_end_object(w);
+      else json_write_end_array(w);
+    }
+  }
+  json_write_end_array(w);
+}
+
+static void
+build_wide(Json_Writer *w, const struct bench_buf *b, ptrdiff_t size)
+{
+  enum { WIDTH = 256 };
+  json_write_begin_array(w);
+  for (long long i = 0; b->len < size; ++i) {
+    json_write_begin_object(w);
+    for (int k = 0; k < WIDTH; ++k) {
+      char key[16];
+      int len = snprintf(key, sizeof(key), "field_%d", k);
+      json_write_key(w, (ustring){ .s = (unsigned char *)key, .len = len });
+      json_write_int(w, i + k);
+    }
+    json_write_end_object(w);
+  }
+  json_write_end_array(w);
+}
+
+// Records shaped like sample_users_with_id.json.
+static void
+build_records(Json_Writer *w, const struct bench_buf *b, ptrdiff_t size)
+{
+  json_write_begin_array(w);
+  for (long long i = 0; b->len < size; ++i) {
+    char email[32];
+    int len = snprintf(email, sizeof(email), "user%lld@test.com", i);
+    ustring e = { .s = (unsigned char *)email, .len = len };
+    json_write_begin_object(w);
+    json_write_key(w, BENCH_US("user_id"));
+    json_write_string(w, BENCH_US("583c3ac3f38e84297c002546"));
+    json_write_key(w, BENCH_US("email"));
+    json_write_string(w, e);
+    json_write_key(w, BENCH_US("name"));
+    json_write_string(w, e);
+    json_write_key(w, BENCH_US("given_name"));
+    json_write_string(w, BENCH_US("Hello"));
+    json_write_key(w, BENCH_US("logins_count"));
+    json_write_int(w, i % 100);
+    json_write_key(w, BENCH_US("created_at"));
+    json_write_string(w, BENCH_US("2016-11-28T14:10:11.338Z"));
+    json_write_key(w, BENCH_US("email_verified"));
+    json_write_bool(w, i % 2);
+    json_write_key(w, BENCH_US("tags"));
+    json_write_begin_array(w);
+    json_write_string(w, BENCH_US("admin"));
+    json_write_null(w);
+    json_write_number(w, 0.25 * (i % 8));
+    json_write_end_array(w);
+    json_write_end_object(w);
+  }
+  json_write_end_array(w);
+}
+
+// Seeded synthetic corpora, the same spec and seed always give the same bytes.
+struct gen_spec {
+  uint64_t seed;
+  ptrdiff_t size;    // stop after the record that reaches this many bytes
+  int keys;          // distinct object keys, fewer means more reuse
+  int str_len;       // mean string length
+  int escape_pct;    // percent of string bytes that need escaping
+  int int_pct;       // percent of numbers that are integers
+  int decimal_pct;   // percent that are decimals, the rest have exponents
+  int depth;         // deepest nesting below a record
+  int width;         // most elements in an array or object
+  bool ndjson;       // records one per line instead of inside one array
+};
+
+static const struct gen_spec gen_default = {
+  .seed = 1, .size = 8 << 20, .keys = 64, .str_len = 16, .escape_pct = 2,
+  .int_pct = 50, .decimal_pct = 30, .depth = 4, .width = 8, .ndjson = false,
+};
+
+struct gen {
+  const struct gen_spec *spec;
+  uint64_t state;
+  Json_Writer *w;
+};
+
+// xorshift64*
+static uint64_t
+gen_next(struct gen *g)
+{
+  g->state ^= g->state >> 12;
+  g->state ^= g->state << 25;
+  g->state ^= g->state >> 27;
+  return g->state * 0x2545F4914F6CDD1DULL;
+}
+
+static int
+gen_below(struct gen *g, int n)
+{
+  return n > 0 ? (int)(gen_next(g) % (uint64_t)n) : 0;
+}
+
+static void
+gen_string(struct gen *g)
+{
+  static const char plain[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 ";
+  static const char escaped[] = "\"\\\n\t\x01";
+  unsigned char buf[1024];
+  int len = 1 + gen_below(g, 2*g->spec->str_len);
+  if (len > (int)sizeof(buf)) len = sizeof(buf);
+  for (int i = 0; i < len; ++i) {
+    if (gen_below(g, 100) < g->spec->escape_pct)
+      buf[i] = escaped[gen_below(g, sizeof(escaped) - 1)];
+    else
+      buf[i] = plain[gen_below(g, sizeof(plain) - 1)];
+  }
+  json_write_string(g->w, (ustring){ .s = buf, .len = len });
+}
+
+static void
+gen_number(struct gen *g)
+{
+  int shape = gen_below(g, 100);
+  long long mantissa = (long long)(gen_next(g) % 2000000001ULL) - 1000000000;
+  if (shape < g->spec->int_pct)
+    json_write_int(g->w, mantissa);
+  else if (shape < g->spec->int_pct + g->spec->decimal_pct)
+    json_write_number(g->w, (double)mantissa / 1000);
+  else {
+    double num = (double)(mantissa % 100000) / 1000;
+    int exp = gen_below(g, 61) - 30;
+    for (; exp > 0; --exp) num *= 10;
+    for (; exp < 0; ++exp) num /= 10;
+    json_write_number(g->w, num);
+  }
+}
+
+static void
+gen_key(struct gen *g, int k)
+{
+  char key[32];
+  int len = snprintf(key, sizeof(key), "key_%d", k);
+  json_write_key(g->w, (ustring){ .s = (unsigned char *)key, .len = len });
+}
+
+static void gen_value(struct gen *g, int depth);
+
+static void
+gen_container(struct gen *g, bool object, int depth)
+{
+  int n = 1 + gen_below(g, g->spec->width);
+  // consecutive keys from a random start keep the keys of an object unique
+  int first = gen_below(g, g->spec->keys);
+  if (object && g->spec->keys > 0 && n > g->spec->keys) n = g->spec->keys;
+  if (object) json_write_begin_object(g->w);
+  else json_write_begin_array(g->w);
+  for (int i = 0; i < n; ++i) {
+    if (object) gen_key(g, g->spec->keys > 0 ? (first + i) % g->spec->keys : i);
+    gen_value(g, depth + 1);
+  }
+  if (object) json_write_end_object(g->w);
+  else json_write_end_array(g->w);
+}
+
+static void
+gen_value(struct gen *g, int depth)
+{
+  int kind = gen_below(g, 100);
+  if (depth < g->spec->depth && kind < 30) gen_container(g, kind < 15, depth);
+  else if (kind < 60) gen_string(g);
+  else if (kind < 85) gen_number(g);
+  else if (kind < 95) json_write_bool(g->w, kind & 1);
+  else json_write_null(g->w);
+}
+
+// Writes records, objects of up to spec->width fields, until the sink has
+// taken spec->size bytes. The writer is flushed after every record so
+// *written is exact.
+static void
+gen_corpus(const struct gen_spec *spec, Json_Writer *w, const ptrdiff_t *written)
+{
+  struct gen g = { .spec = spec, .state = spec->seed ? spec->seed : 1, .w = w };
+  if (!spec->ndjson) json_write_begin_array(w);
+  while (*written < spec->size) {
+    gen_container(&g, true, 0);
+    if (!json_writer_flush(w)) return;
+  }
+  if (!spec->ndjson) json_write_end_array(w);
+}
+
+// Counts the bytes on their way to the real sink.
+struct gen_count_sink {
+  struct json_sink inner;
+  ptrdiff_t total;
+};
+
+static bool
+gen_count_write(const unsigned char *buf, ptrdiff_t len, void *ctx)
+{
+  struct gen_count_sink *c = ctx;
+  c->total += len;
+  return c->inner.write(buf, len, c->inner.ctx);
+}
+
+// Parses one generator option at argv[*i], false if it is not one.
+static bool
+gen_option(struct gen_spec *spec, int argc, char **argv, int *i)
+{
+  const char *opt = argv[*i];
+  if (strcmp(opt, "-ndjson") == 0) {
+    spec->ndjson = true;
+    return true;
+  }
+  static const struct { const char *name; int offset; } ints[] = {
+    { "-keys", offsetof(struct gen_spec, keys) },
+    { "-strlen", offsetof(struct gen_spec, str_len) },
+    { "-escapes", offsetof(struct gen_spec, escape_pct) },
+    { "-ints", offsetof(struct gen_spec, int_pct) },
+    { "-decimals", offsetof(struct gen_spec, decimal_pct) },
+    { "-depth", offsetof(struct gen_spec, depth) },
+    { "-width", offsetof(struct gen_spec, width) },
+  };
+  if (*i + 1 >= argc) return false;
+  if (strcmp(opt, "-seed") == 0) {
+    spec->seed = strtoull(argv[++*i], NULL, 10);
+    return true;
+  }
+  for (size_t k = 0; k < ARRAY_LEN(ints); ++k) {
+    if (strcmp(opt, ints[k].name) == 0) {
+      *(int *)((char *)spec + ints[k].offset) = atoi(argv[++*i]);
+      return true;
+    }
+  }
+  return false;
+}
+
+// perf_program gen [generator options] [-s bytes] [-pretty] [-o file]
+static int
+gen_main(int argc, char **argv)
+{
+  struct gen_spec spec = gen_default;
+  int flags = JSON_WRITE_COMPACT;
+  const char *path = NULL;
+  for (int i = 2; i < argc; ++i) {
+    if (gen_option(&spec, argc, argv, &i)) continue;
+    if (strcmp(argv[i], "-pretty") == 0) flags = JSON_WRITE_PRETTY;
+    else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) spec.size = atoll(argv[++i]);
+    else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) path = argv[++i];
+    else {
+      fprintf(stderr, "unknown or incomplete option %s\n", argv[i]);
+      return 1;
     }
-
-    closedir(dir);
-    return result;
+  }
+  FILE *f = path ? fopen(path, "wb") : stdout;
+  if (!f) {
+    perror(path);
+    return 1;
+  }
+  struct gen_count_sink count = { .inner = json_file_sink(f), .total = 0 };
+  Json_Writer *w = make_writer((struct json_sink){ .write = gen_count_write, .ctx = &count },
+                               lib_allocator, flags);
+  gen_corpus(&spec, w, &count.total);
+  bool ok = destroy_writer(w);
+  if (path) ok = fclose(f) == 0 && ok;
+  return ok ? 0 : 1;
 }
 
-static int test_parse_null() {
-  unsigned char * str = (unsigned char *)"null";
-    struct json_string_source_ctx ssc = make_ss(str, strlen((char *)str));
-    Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
-    const Json_View *v = json_parse(p);
-    if (!(json_type(v) == JSON_NULL)) return 1;
-    fprintf(stdout, "test parse null : SUCCESS\n");
-    destroy_parser(p);
-    return 0;
+// Generator options given to the bench apply to the synthetic corpora.
+static struct gen_spec bench_spec;
+// Read hardware counters around the timed parses, -nohw turns them off.
+static bool bench_hw = true;
+
+static void
+build_synthetic(Json_Writer *w, const struct bench_buf *b, ptrdiff_t size)
+{
+  struct gen_spec spec = bench_spec;
+  spec.size = size;
+  spec.ndjson = false;
+  gen_corpus(&spec, w, &b->len);
 }
 
-static int test_parse_bool() {
-  unsigned char * str = (unsigned char *)"true";
-    struct json_string_source_ctx ssc = make_ss(str, strlen((char *)str));
-    Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
-    const Json_View *v = json_parse(p);
-    if (!(json_type(v) == JSON_BOOL)) return 1;
-    if (!(json_bool(v) == true)) return 1;
-    fprintf(stdout, "test parse bool : SUCCESS\n");
-    destroy_parser(p);
-    return 0;
+static void
+build_synthetic_ndjson(Json_Writer *w, const struct bench_buf *b, ptrdiff_t size)
+{
+  struct gen_spec spec = bench_spec;
+  spec.size = size;
+  spec.ndjson = true;
+  gen_corpus(&spec, w, &b->len);
 }
 
-static int test_parse_number() {
-  unsigned char * str = (unsigned char *)"123.45";
-    struct json_string_source_ctx ssc = make_ss(str, strlen((char *)str));
-    Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
-    const Json_View *v = json_parse(p);
-    if (!(json_type(v) == JSON_NUMBER)) return 1;
-    if (!(json_number(v) == 123.45)) return 1;
-    fprintf(stdout, "test parse number : SUCCESS\n");
-    destroy_parser(p);
-    return 0;
+struct bench_corpus {
+  const char *name;
+  int flags;
+  bool ndjson;
+  void (*build)(Json_Writer *w, const struct bench_buf *b, ptrdiff_t size);
+};
+
+static const struct bench_corpus bench_corpora[] = {
+  { "strings", JSON_WRITE_COMPACT, false, build_strings },
+  { "numbers", JSON_WRITE_COMPACT, false, build_numbers },
+  { "nested", JSON_WRITE_COMPACT, false, build_nested },
+  { "wide", JSON_WRITE_COMPACT, false, build_wide },
+  { "records", JSON_WRITE_COMPACT, false, build_records },
+  { "records_pretty", JSON_WRITE_PRETTY, false, build_records },
+  { "synthetic", JSON_WRITE_COMPACT, false, build_synthetic },
+  { "synthetic_ndjson", JSON_WRITE_COMPACT, true, build_synthetic_ndjson },
+};
+
+static double
+bench_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
 }
 
-static int test_parse_string() {
-  unsigned char * str = (unsigned char *)"\"hello\"";
-    struct json_string_source_ctx ssc = make_ss(str, strlen((char *)str));
-    Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
-    const Json_View *v = json_parse(p);
-    if (!(json_type(v) == JSON_STRING)) return 1;
-    ustring s = json_string(v);
-    if (!(memcmp(s.s, "hello", s.len) == 0)) return 1;
-    fprintf(stdout, "test parse string : SUCCESS\n");
-    destroy_parser(p);
-    return 0;
+static int
+bench_cmp_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
 }
 
-static int test_parse_array() {
-    unsigned char * str = (unsigned char *)"[1, true, null, {\"a\": 1}]";
-    struct json_string_source_ctx ssc = make_ss(str, strlen((char *)str));
-    Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
-    const Json_View *v = json_parse(p);
-    if (!(json_type(v) == JSON_ARRAY)) return 1;
-    if (!(json_array_len(v) == 4)) return 1;
-    if (!(json_type(json_array_at(v, 0)) == JSON_NUMBER)) return 1;
-    if (!(json_number(json_array_at(v, 0)) == 1)) return 1;
-    if (!(json_bool(json_array_at(v, 1)) == true)) return 1;
-    if (!(json_type(json_array_at(v, 2)) == JSON_NULL)) return 1;
-    if (!(json_type(json_array_at(v, 3)) == JSON_OBJECT)) return 1;
-    fprintf(stdout, "test parse array : SUCCESS\n");
-    destroy_parser(p);
-    return 0;
+// Hardware counters around every timed parse through perf_event_open. Each
+// counter is opened on its own so the ones the CPU or kernel refuse only
+// leave a gap in the report.
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+enum hw_counter {
+  HW_CYCLES,
+  HW_INSTRUCTIONS,
+  HW_BRANCH_MISSES,
+  HW_L1D_MISSES,
+  HW_LLC_MISSES,
+  HW_DTLB_MISSES,
+  HW_COUNTER_SIZE
+};
+
+struct hw_counters {
+  int fd[HW_COUNTER_SIZE];  // -1 when the counter is not available
+  double val[HW_COUNTER_SIZE];
+};
+
+static void
+hw_open(struct hw_counters *hc, bool enabled)
+{
+  for (int i = 0; i < HW_COUNTER_SIZE; ++i) {
+    hc->fd[i] = -1;
+    hc->val[i] = 0;
+  }
+#ifdef __linux__
+  if (!enabled) return;
+  static const struct { uint32_t type; uint64_t config; } events[HW_COUNTER_SIZE] = {
+    [HW_CYCLES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    [HW_INSTRUCTIONS] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    [HW_BRANCH_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    [HW_L1D_MISSES] = { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D
+                        | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+    [HW_LLC_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    [HW_DTLB_MISSES] = { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB
+                         | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+  };
+  for (int i = 0; i < HW_COUNTER_SIZE; ++i) {
+    struct perf_event_attr attr = {0};
+    attr.size = sizeof(attr);
+    attr.type = events[i].type;
+    attr.config = events[i].config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    hc->fd[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+#else
+  (void)enabled;
+#endif
 }
 
-static int test_parse_object() {
-    unsigned char * str = (unsigned char *)"{\"a\": 1, \"b\": false}";
-    struct json_string_source_ctx ssc = make_ss(str, strlen((char *)str));
-    Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
-    const Json_View *v = json_parse(p);
-    if (!(json_type(v) == JSON_OBJECT)) return 1;
-    ptrdiff_t count = 0;
+static bool
+hw_available(const struct hw_counters *hc)
+{
+  for (int i = 0; i < HW_COUNTER_SIZE; ++i) {
+    if (hc->fd[i] >= 0) return true;
+  }
+  return false;
+}
 
-    const ustring *keys = json_object_keys(v, &count);
-    if (!(count == 2)) return 1;
-    const Json_View *val = json_object_val(v, (ustring){.s = (unsigned char *)"a", .len = 1});
-    if (!(val->type == JSON_NUMBER)) return 1;
-    if (!(json_number(val) == 1.0)) return 1;
-    val = json_object_val(v, (ustring){.s = (unsigned char *)"b", .len = 1});
-    if (!(val->type == JSON_BOOL)) return 1;
-    if (!(json_bool(val) == false)) return 1;
-    fprintf(stdout, "test parse object : SUCCESS\n");
-    destroy_parser(p);
-    return 0;
+static void
+hw_start(struct hw_counters *hc)
+{
+#ifdef __linux__
+  for (int i = 0; i < HW_COUNTER_SIZE; ++i) {
+    if (hc->fd[i] < 0) continue;
+    ioctl(hc->fd[i], PERF_EVENT_IOC_RESET, 0);
+    ioctl(hc->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+  }
+#else
+  (void)hc;
+#endif
 }
 
-#ifdef PERF_TEST
+// Adds what the counters saw since hw_start, scaled up when the kernel had
+// to multiplex them.
+static void
+hw_stop(struct hw_counters *hc)
+{
+#ifdef __linux__
+  for (int i = 0; i < HW_COUNTER_SIZE; ++i) {
+    if (hc->fd[i] < 0) continue;
+    ioctl(hc->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+    uint64_t buf[3];
+    if (read(hc->fd[i], buf, sizeof(buf)) != sizeof(buf) || buf[2] == 0) continue;
+    hc->val[i] += (double)buf[0] * ((double)buf[1] / (double)buf[2]);
+  }
+#else
+  (void)hc;
+#endif
+}
 
+static void
+hw_close(struct hw_counters *hc)
+{
+  for (int i = 0; i < HW_COUNTER_SIZE; ++i) {
+    if (hc->fd[i] >= 0) close(hc->fd[i]);
+  }
+}
 
-struct json_file_ctx {
-  FILE *f;
-  int c;
+static const char *const hw_rate_names[HW_COUNTER_SIZE] = {
+  "cycles/B", "IPC", "br-miss/KB", "L1d-miss/KB", "LLC-miss/KB", "dTLB-miss/KB",
+};
+static const char *const hw_csv_names[HW_COUNTER_SIZE] = {
+  "cycles_per_byte", "ipc", "branch_misses_per_kb", "l1d_misses_per_kb",
+  "llc_misses_per_kb", "dtlb_misses_per_kb",
 };
 
-static void
-file_next_byte(void *ctx)
+// Rate i is derived from counter i: cycles per byte, instructions per cycle
+// and the misses per KB. False when the counter is not available.
+static bool
+hw_rate(const struct hw_counters *hc, int i, double bytes, double *rate)
 {
-  struct json_file_ctx *ss = ctx;
-  int val = fgetc(ss->f);
-  if (val != EOF) {
-    ss->c = val;
+  if (hc->fd[i] < 0) return false;
+  switch (i) {
+  case HW_CYCLES:
+    *rate = hc->val[i] / bytes;
+    return true;
+  case HW_INSTRUCTIONS:
+    if (hc->fd[HW_CYCLES] < 0 || hc->val[HW_CYCLES] == 0) return false;
+    *rate = hc->val[i] / hc->val[HW_CYCLES];
+    return true;
+  default:
+    *rate = hc->val[i] / (bytes / 1024);
+    return true;
   }
 }
 
-static unsigned char
-file_get_byte(void *ctx)
+// Parses buf once to warm up and then iters more times, reusing the parser
+// like a long running service would. NDJSON is parsed one record at a time.
+static int
+bench_run(const char *name, unsigned char *buf, ptrdiff_t len, bool ndjson, int iters, FILE *csv)
 {
-  struct json_file_ctx *ss = ctx;
-  return (unsigned char)ss->c;
+  struct json_string_source_ctx ssc = make_ss(buf, len);
+  Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
+  json_parser_set_streaming(p, ndjson);
+  struct hw_counters hc;
+  hw_open(&hc, bench_hw);
+  double *times = malloc(iters * sizeof(double));
+  for (int i = -1; i < iters; ++i) {
+    ssc = make_ss(buf, len);
+    const Json_View *v;
+    if (i >= 0) hw_start(&hc);
+    double start = bench_now();
+    do {
+      json_parser_reset(p);
+      v = json_parse(p);
+      // the newline after the last record doesn't start another one
+      if (ndjson) skip_whitespace(p);
+    } while (ndjson && json_type(v) != JSON_ERROR && has_next_byte(p));
+    double end = bench_now();
+    if (i >= 0) hw_stop(&hc);
+    if (json_type(v) == JSON_ERROR) {
+      fprintf(stderr, "%s: %s\n", name, json_parser_error(p));
+      free(times);
+      hw_close(&hc);
+      destroy_parser(p);
+      return 1;
+    }
+    if (i >= 0) times[i] = end - start;
+  }
+  qsort(times, iters, sizeof(double), bench_cmp_double);
+  double min = times[0], median = times[iters / 2], max = times[iters - 1];
+  double gbps = len / median / 1e9, ns_per_byte = median * 1e9 / len;
+  printf("%-16s %11td bytes %8.3f GB/s %7.2f ns/byte   min %.4fs median %.4fs max %.4fs\n",
+         name, len, gbps, ns_per_byte, min, median, max);
+  if (hw_available(&hc)) {
+    printf(" ");
+    for (int c = 0; c < HW_COUNTER_SIZE; ++c) {
+      double rate;
+      if (hw_rate(&hc, c, (double)len * iters, &rate)) printf(" %s %.3f", hw_rate_names[c], rate);
+      else printf(" %s -", hw_rate_names[c]);
+    }
+    printf("\n");
+  }
+  if (csv) {
+    fprintf(csv, "%s,%td,%d,%.9f,%.9f,%.9f,%.6f,%.4f",
+            name, len, iters, min, median, max, gbps, ns_per_byte);
+    for (int c = 0; c < HW_COUNTER_SIZE; ++c) {
+      double rate;
+      if (hw_rate(&hc, c, (double)len * iters, &rate)) fprintf(csv, ",%.4f", rate);
+      else fprintf(csv, ",");
+    }
+    fprintf(csv, "\n");
+  }
+#ifdef JP_STATS
+  // counters of the last run, for NDJSON only of its last record
+  struct json_stats st;
+  json_parser_stats(p, &st);
+  printf("  literal/string/number steps %td/%td/%td, string appends %td, copies %td (%td bytes),"
+         " grows %td, blocks %td (%td bytes), depth %td\n",
+         st.transitions[JSON_STATS_LITERAL], st.transitions[JSON_STATS_STRING],
+         st.transitions[JSON_STATS_NUMBER], st.string_appends, st.copies, st.bytes_copied,
+         st.container_grows, st.arena_blocks, st.arena_bytes, st.peak_depth);
+#endif
+  free(times);
+  hw_close(&hc);
+  destroy_parser(p);
+  return 0;
 }
 
-static bool
-file_has_next_byte(void *ctx)
+// Allocator that counts what the parser asks for, every block carries its
+// size in front so the frees can be counted too.
+struct count_alloc {
+  ptrdiff_t allocs;
+  ptrdiff_t live;
+  ptrdiff_t peak;
+};
+
+static void *
+count_malloc(ptrdiff_t sz, void *ctx)
 {
-  struct json_file_ctx *ss = ctx;
-  return (ss->c == EOF);
+  struct count_alloc *c = ctx;
+  max_align_t *mem = malloc(sizeof(max_align_t) + sz);
+  if (mem == NULL) return NULL;
+  *(ptrdiff_t *)mem = sz;
+  ++c->allocs;
+  c->live += sz;
+  if (c->live > c->peak) c->peak = c->live;
+  return mem + 1;
 }
 
-struct json_source file_source_make(char *fname, struct json_file_ctx *ctx) {
-  ctx->f = fopen(fname, "r");
-  ctx->c = fgetc(ctx->f);
-  return (struct json_source) {
-    .next = file_next_byte,
-    .get_byte = file_get_byte,
-    .has_next = file_has_next_byte,
-    .ctx = (void*)ctx,
-  };
+static void
+count_free(void *ptr, void *ctx)
+{
+  struct count_alloc *c = ctx;
+  if (ptr == NULL) return;
+  max_align_t *mem = (max_align_t *)ptr - 1;
+  c->live -= *(ptrdiff_t *)mem;
+  free(mem);
 }
 
-char *read_entire_file(const char *filename, ptrdiff_t *out_len) {
-    // Open the file for reading
-    FILE *file = fopen(filename, "rb");
-    if (!file) {
-        perror("File opening failed");
-        return NULL;
+// Bytes of a document in its nodes (array elements, object keys and values)
+// and in its strings including their NUL.
+struct doc_bytes {
+  ptrdiff_t nodes;
+  ptrdiff_t strings;
+};
+
+static void
+doc_count(const struct json_ast_node *v, struct doc_bytes *d)
+{
+  if (v->type == JSON_STRING) d->strings += v->value.s.len + 1;
+  else if (v->type == JSON_ARRAY) d->nodes += v->value.vec.len * (ptrdiff_t)sizeof(struct json_ast_node);
+  else if (v->type == JSON_OBJECT) d->nodes += v->value.obj.len * (ptrdiff_t)(sizeof(ustring) + sizeof(struct json_ast_node));
+}
+
+// Visits the containers from a work list instead of recursing, documents can
+// be nested far deeper than the C stack allows.
+static bool
+doc_walk(const struct json_ast_node *v, struct doc_bytes *d)
+{
+  const struct json_ast_node **todo = NULL;
+  ptrdiff_t len = 0, cap = 0;
+  doc_count(v, d);
+  for (;;) {
+    ptrdiff_t n = 0;
+    const struct json_ast_node *children = NULL;
+    if (v->type == JSON_ARRAY) {
+      n = v->value.vec.len;
+      children = v->value.vec.arr;
+    } else if (v->type == JSON_OBJECT) {
+      n = v->value.obj.len;
+      children = v->value.obj.vals;
+      for (ptrdiff_t i = 0; i < n; ++i) d->strings += v->value.obj.keys[i].len + 1;
+    }
+    for (ptrdiff_t i = 0; i < n; ++i) {
+      const struct json_ast_node *c = &children[i];
+      doc_count(c, d);
+      if (c->type != JSON_ARRAY && c->type != JSON_OBJECT) continue;
+      if (len == cap) {
+        cap = cap ? 2*cap : 256;
+        const struct json_ast_node **tmp = realloc(todo, cap * sizeof(*todo));
+        if (tmp == NULL) {
+          free(todo);
+          return false;
+        }
+        todo = tmp;
+      }
+      todo[len++] = c;
     }
+    if (len == 0) break;
+    v = todo[--len];
+  }
+  free(todo);
+  return true;
+}
 
-    // Move the file pointer to the end of the file to determine its size
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    if (file_size == -1) {
-        perror("Failed to determine file size");
-        fclose(file);
-        return NULL;
+// Parses buf once through a counting allocator and splits the arena memory
+// the document keeps into nodes, strings and slack, which is everything else:
+// spare capacity, buffers abandoned by growth and the unused end of blocks.
+// NDJSON records all stay in the arena, as a streaming caller keeping them would.
+static int
+mem_run(const char *name, unsigned char *buf, ptrdiff_t len, bool ndjson, int iters, FILE *csv)
+{
+  (void)iters;
+  struct count_alloc ca = {0};
+  struct json_allocator al = { .al_malloc = count_malloc, .al_free = count_free, .ctx = &ca };
+  struct json_string_source_ctx ssc = make_ss(buf, len);
+  Json_Parser *p = make_parser(string_source_make(&ssc), al);
+  json_parser_set_streaming(p, ndjson);
+  struct doc_bytes d = {0};
+  const Json_View *v;
+  do {
+    v = json_parse(p);
+    if (!doc_walk(v, &d)) {
+      fprintf(stderr, "%s: out of memory\n", name);
+      destroy_parser(p);
+      return 1;
     }
+    if (ndjson) skip_whitespace(p);
+  } while (ndjson && json_type(v) != JSON_ERROR && has_next_byte(p));
+  if (json_type(v) == JSON_ERROR) {
+    fprintf(stderr, "%s: %s\n", name, json_parser_error(p));
+    destroy_parser(p);
+    return 1;
+  }
+  ptrdiff_t resident = json_parser_memory(p).reserved;
+  ptrdiff_t slack = resident - d.nodes - d.strings;
+  double in = (double)len;
+  printf("%-16s %11td bytes %8td allocs  peak heap %8.2f MiB  resident/input %6.2f"
+         " = nodes %.2f + strings %.2f + slack %.2f\n",
+         name, len, ca.allocs, ca.peak / (1024.0 * 1024.0), resident / in,
+         d.nodes / in, d.strings / in, slack / in);
+  if (csv) {
+    fprintf(csv, "%s,%td,%td,%td,%td,%td,%td,%td,%.4f\n",
+            name, len, ca.allocs, ca.peak, resident, d.nodes, d.strings, slack, resident / in);
+  }
+  destroy_parser(p);
+  return 0;
+}
 
-    // Move the file pointer back to the beginning of the file
-    fseek(file, 0, SEEK_SET);
+static void
+mem_csv_header(FILE *csv)
+{
+  fprintf(csv, "corpus,bytes,allocations,peak_heap,resident,nodes,strings,slack,resident_per_input\n");
+}
 
-    // Allocate memory to store the file content
-    char *buffer = (char *)malloc(file_size + 1);  // +1 for the null terminator
-    if (!buffer) {
-        perror("Memory allocation failed");
-        fclose(file);
-        return NULL;
-    }
+static void
+bench_csv_header(FILE *csv)
+{
+  fprintf(csv, "corpus,bytes,iterations,min_s,median_s,max_s,gb_per_s,ns_per_byte");
+  for (int c = 0; c < HW_COUNTER_SIZE; ++c) fprintf(csv, ",%s", hw_csv_names[c]);
+  fprintf(csv, "\n");
+}
 
-    // Read the file content into the buffer
-    size_t bytes_read = fread(buffer, 1, file_size, file);
-    if (bytes_read != file_size) {
-        perror("Failed to read entire file");
-        free(buffer);
-        fclose(file);
-        return NULL;
-    }
+// What bench_main measures on every corpus.
+struct bench_mode {
+  void (*csv_header)(FILE *csv);
+  int (*run)(const char *name, unsigned char *buf, ptrdiff_t len, bool ndjson, int iters, FILE *csv);
+};
 
-    // Null-terminate the string
-    buffer[file_size] = '\0';
+static const struct bench_mode bench_throughput = { bench_csv_header, bench_run };
+static const struct bench_mode bench_memory = { mem_csv_header, mem_run };
 
-    // Set the output length
-    if (out_len) {
-        *out_len = file_size;
+// perf_program [mem] [-n iterations] [-s corpus_bytes] [-o results.csv] [-nohw] [generator options] [file.json ...]
+// Without files every built in corpus is generated at corpus_bytes and
+// measured, timed by default or for its memory footprint with mem. Files
+// ending in .ndjson or .jsonl are parsed one record at a time.
+static int
+bench_main(int argc, char **argv, const struct bench_mode *mode)
+{
+  bench_spec = gen_default;
+  int iters = 10;
+  ptrdiff_t size = 8 << 20;
+  const char *csv_path = NULL;
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; ++i) {
+    if (gen_option(&bench_spec, argc, argv, &i)) continue;
+    if (strcmp(argv[i], "-nohw") == 0) {
+      bench_hw = false;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      fprintf(stderr, "%s needs a value\n", argv[i]);
+      return 1;
+    }
+    if (strcmp(argv[i], "-n") == 0) iters = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-s") == 0) size = atoll(argv[++i]);
+    else if (strcmp(argv[i], "-o") == 0) csv_path = argv[++i];
+    else {
+      fprintf(stderr, "unknown option %s\n", argv[i]);
+      return 1;
     }
+  }
+  if (iters < 1) iters = 1;
+
+  FILE *csv = NULL;
+  if (csv_path) {
+    csv = fopen(csv_path, "w");
+    if (!csv) {
+      perror(csv_path);
+      return 1;
+    }
+    mode->csv_header(csv);
+  }
 
-    // Close the file and return the buffer
-    fclose(file);
-    return buffer;
+  int res = 0;
+  if (i < argc) {
+    for (; i < argc; ++i) {
+      ptrdiff_t len;
+      unsigned char *str = (unsigned char *)read_entire_file(argv[i], &len);
+      if (!str) {
+        res = 1;
+        continue;
+      }
+      const char *ext = strrchr(argv[i], '.');
+      bool ndjson = ext && (strcmp(ext, ".ndjson") == 0 || strcmp(ext, ".jsonl") == 0);
+      res |= mode->run(argv[i], str, len, ndjson, iters, csv);
+      free(str);
+    }
+  } else {
+    for (size_t c = 0; c < ARRAY_LEN(bench_corpora); ++c) {
+      struct bench_buf b = {0};
+      Json_Writer *w = make_writer((struct json_sink){ .write = bench_buf_write, .ctx = &b },
+                                   lib_allocator, bench_corpora[c].flags);
+      bench_corpora[c].build(w, &b, size);
+      if (!destroy_writer(w)) {
+        fprintf(stderr, "%s: could not build the corpus\n", bench_corpora[c].name);
+        free(b.buf);
+        res = 1;
+        continue;
+      }
+      res |= mode->run(bench_corpora[c].name, b.buf, b.len, bench_corpora[c].ndjson, iters, csv);
+      free(b.buf);
+    }
+  }
+  if (csv) fclose(csv);
+  return res;
 }
-
-#include <time.h>
 #endif
 
 int 
@@ -1569,18 +5085,9 @@ main(int argc, char **argv)
   int res = 0;
 
   #ifdef PERF_TEST
-  ptrdiff_t len;
-  unsigned char *str = read_entire_file("large-file.json", &len);
-  struct json_string_source_ctx ssc = make_ss(str, len);
-  Json_Parser *p = make_parser(string_source_make(&ssc), lib_allocator);
-  json_parser_set_max_depth(p, 200);
-  clock_t start_time = clock();
-  const Json_View *v = json_parse(p);
-  clock_t end_time = clock();
-  //print_json_node(p, *v);
-  fprintf(stderr, "\n Function execution time: %lf seconds\n", (double)(end_time - start_time)/CLOCKS_PER_SEC);
-  destroy_parser(p);
-  free(str);
+  if (argc > 1 && strcmp(argv[1], "gen") == 0) res = gen_main(argc, argv);
+  else if (argc > 1 && strcmp(argv[1], "mem") == 0) res = bench_main(argc - 1, argv + 1, &bench_memory);
+  else res = bench_main(argc, argv, &bench_throughput);
   #else
   res += test_parse_null();
   res += test_parse_bool();
@@ -1588,6 +5095,25 @@ main(int argc, char **argv)
   res += test_parse_string();
   res += test_parse_array();
   res += test_parse_object();
+  res += test_parser_reset();
+  res += test_parse_large_array();
+  res += test_arena_grow_in_place();
+  res += test_parse_exact_size();
+  res += test_parse_scratch_build();
+  res += test_parse_deep_nesting();
+  res += test_serialize();
+  res += test_writer();
+  res += test_builder();
+  res += test_decode();
+  res += test_error_position();
+  res += test_stats();
+  res += test_parser_memory();
+  res += test_block_cache();
+  res += test_clone();
+  res += test_parser_compact();
+  res += test_adaptive_size();
+  res += test_projection();
+  res += test_generated_decode();
   res += process_directory("test_files");
   #endif
   // if any test fails the result is non zero
@@ -0,0 +1,100 @@
+// Generated by schema_gen.py from sample_user.schema.json, do not edit.
+#ifndef SAMPLE_USER_SCHEMA_JSON_GENERATED
+#define SAMPLE_USER_SCHEMA_JSON_GENERATED
+
+#include <stdint.h>
+#include <string.h>
+#include "json_parser.h"
+
+struct sample_user {
+  ustring user_id;
+  ustring email;
+  ustring name;
+  ustring given_name;
+  ustring family_name;
+  ustring nickname;
+  ustring last_ip;
+  int64_t logins_count;
+  ustring created_at;
+  ustring updated_at;
+  ustring last_login;
+  bool email_verified;
+};
+
+static ptrdiff_t
+sample_user_match(const unsigned char *key, ptrdiff_t len)
+{
+  switch (len) {
+  case 4:
+    if (memcmp(key, "name", 4) == 0) return 2;
+    return -1;
+  case 5:
+    if (memcmp(key, "email", 5) == 0) return 1;
+    return -1;
+  case 7:
+    switch (key[0]) {
+    case 'u':
+      if (memcmp(key, "user_id", 7) == 0) return 0;
+      return -1;
+    case 'l':
+      if (memcmp(key, "last_ip", 7) == 0) return 6;
+      return -1;
+    }
+    return -1;
+  case 8:
+    if (memcmp(key, "nickname", 8) == 0) return 5;
+    return -1;
+  case 10:
+    switch (key[0]) {
+    case 'g':
+      if (memcmp(key, "given_name", 10) == 0) return 3;
+      return -1;
+    case 'c':
+      if (memcmp(key, "created_at", 10) == 0) return 8;
+      return -1;
+    case 'u':
+      if (memcmp(key, "updated_at", 10) == 0) return 9;
+      return -1;
+    case 'l':
+      if (memcmp(key, "last_login", 10) == 0) return 10;
+      return -1;
+    }
+    return -1;
+  case 11:
+    if (memcmp(key, "family_name", 11) == 0) return 4;
+    return -1;
+  case 12:
+    if (memcmp(key, "logins_count", 12) == 0) return 7;
+    return -1;
+  case 14:
+    if (memcmp(key, "email_verified", 14) == 0) return 11;
+    return -1;
+  }
+  return -1;
+}
+
+static const struct json_field sample_user_fields[] = {
+  { "user_id", JSON_FIELD_STRING, offsetof(struct sample_user, user_id), true, NULL },
+  { "email", JSON_FIELD_STRING, offsetof(struct sample_user, email), true, NULL },
+  { "name", JSON_FIELD_STRING, offsetof(struct sample_user, name), false, NULL },
+  { "given_name", JSON_FIELD_STRING, offsetof(struct sample_user, given_name), false, NULL },
+  { "family_name", JSON_FIELD_STRING, offsetof(struct sample_user, family_name), false, NULL },
+  { "nickname", JSON_FIELD_STRING, offsetof(struct sample_user, nickname), false, NULL },
+  { "last_ip", JSON_FIELD_STRING, offsetof(struct sample_user, last_ip), false, NULL },
+  { "logins_count", JSON_FIELD_INT, offsetof(struct sample_user, logins_count), false, NULL },
+  { "created_at", JSON_FIELD_STRING, offsetof(struct sample_user, created_at), false, NULL },
+  { "updated_at", JSON_FIELD_STRING, offsetof(struct sample_user, updated_at), false, NULL },
+  { "last_login", JSON_FIELD_STRING, offsetof(struct sample_user, last_login), false, NULL },
+  { "email_verified", JSON_FIELD_BOOL, offsetof(struct sample_user, email_verified), false, NULL },
+};
+static const struct json_struct_desc sample_user_desc = {
+  sample_user_fields, 12, sample_user_match
+};
+
+static inline bool
+decode_sample_user(Json_Parser *p, struct sample_user *out)
+{
+  return json_decode(p, &sample_user_desc, out);
+}
+
+#endif
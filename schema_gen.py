@@ -0,0 +1,145 @@
+#!/bin/python3
+# Generates a C header with structs, json_struct_desc tables and key matchers
+# specialised to a schema, for use with json_decode.
+#
+#   python3 schema_gen.py sample_user.schema.json > sample_user_schema.h
+#
+# The schema lists structs in dependency order:
+#   {"structs": [{"name": "user", "fields": [
+#       {"name": "id", "type": "int", "required": true},
+#       {"name": "address", "type": "object", "struct": "address"}]}]}
+import json
+import re
+import sys
+
+C_TYPES = {
+    "bool": "bool",
+    "int": "int64_t",
+    "double": "double",
+    "string": "ustring",
+    "view": "const Json_View *",
+}
+
+FIELD_TYPES = {
+    "bool": "JSON_FIELD_BOOL",
+    "int": "JSON_FIELD_INT",
+    "double": "JSON_FIELD_DOUBLE",
+    "string": "JSON_FIELD_STRING",
+    "object": "JSON_FIELD_OBJECT",
+    "view": "JSON_FIELD_VIEW",
+}
+
+def c_ident(name):
+    ident = re.sub(r'[^0-9A-Za-z_]', '_', name)
+    if ident[0].isdigit():
+        ident = '_' + ident
+    return ident
+
+def c_string(s):
+    return '"' + s.replace('\\', '\\\\').replace('"', '\\"') + '"'
+
+def c_char(byte):
+    if 0x20 <= byte < 0x7f and chr(byte) not in "'\\":
+        return f"'{chr(byte)}'"
+    return str(byte)
+
+def member_name(field):
+    return field.get("c_name", c_ident(field["name"]))
+
+def emit_struct(st):
+    lines = [f"struct {st['name']} {{"]
+    for f in st["fields"]:
+        if f["type"] == "object":
+            ctype = f"struct {f['struct']}"
+        else:
+            ctype = C_TYPES[f["type"]]
+        sep = "" if ctype.endswith("*") else " "
+        lines.append(f"  {ctype}{sep}{member_name(f)};")
+    lines.append("};")
+    return "\n".join(lines)
+
+def split_position(names):
+    """First byte position where every name of the same length differs."""
+    for pos in range(len(names[0])):
+        if len({n[pos] for n in names}) == len(names):
+            return pos
+    return None
+
+def emit_compare(name, index, indent):
+    return [f"{indent}if (memcmp(key, {c_string(name)}, {len(name.encode())}) == 0) return {index};"]
+
+def emit_matcher(st):
+    by_len = {}
+    for i, f in enumerate(st["fields"]):
+        by_len.setdefault(len(f["name"].encode()), []).append((f["name"], i))
+
+    lines = [
+        "static ptrdiff_t",
+        f"{st['name']}_match(const unsigned char *key, ptrdiff_t len)",
+        "{",
+        "  switch (len) {",
+    ]
+    for length in sorted(by_len):
+        group = by_len[length]
+        lines.append(f"  case {length}:")
+        pos = split_position([n.encode() for n, _ in group]) if len(group) > 1 else None
+        if pos is None:
+            for name, index in group:
+                lines += emit_compare(name, index, "    ")
+        else:
+            lines.append(f"    switch (key[{pos}]) {{")
+            for name, index in group:
+                lines.append(f"    case {c_char(name.encode()[pos])}:")
+                lines += emit_compare(name, index, "      ")
+                lines.append("      return -1;")
+            lines.append("    }")
+        lines.append("    return -1;")
+    lines += ["  }", "  return -1;", "}"]
+    return "\n".join(lines)
+
+def emit_desc(st):
+    name = st["name"]
+    lines = [f"static const struct json_field {name}_fields[] = {{"]
+    for f in st["fields"]:
+        desc = f"&{f['struct']}_desc" if f["type"] == "object" else "NULL"
+        required = "true" if f.get("required", False) else "false"
+        lines.append(f"  {{ {c_string(f['name'])}, {FIELD_TYPES[f['type']]}, "
+                     f"offsetof(struct {name}, {member_name(f)}), {required}, {desc} }},")
+    lines.append("};")
+    lines.append(f"static const struct json_struct_desc {name}_desc = {{")
+    lines.append(f"  {name}_fields, {len(st['fields'])}, {name}_match")
+    lines.append("};")
+    lines.append("")
+    lines.append("static inline bool")
+    lines.append(f"decode_{name}(Json_Parser *p, struct {name} *out)")
+    lines.append("{")
+    lines.append(f"  return json_decode(p, &{name}_desc, out);")
+    lines.append("}")
+    return "\n".join(lines)
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit(f"usage: {sys.argv[0]} schema.json > schema.h")
+    with open(sys.argv[1]) as fp:
+        schema = json.load(fp)
+
+    guard = c_ident(sys.argv[1]).upper() + "_GENERATED"
+    out = [
+        f"// Generated by schema_gen.py from {sys.argv[1]}, do not edit.",
+        f"#ifndef {guard}",
+        f"#define {guard}",
+        "",
+        "#include <stdint.h>",
+        "#include <string.h>",
+        "#include \"json_parser.h\"",
+        "",
+    ]
+    for st in schema["structs"]:
+        if len(st["fields"]) > 64:
+            sys.exit(f"{st['name']}: json_decode supports at most 64 fields")
+        out += [emit_struct(st), "", emit_matcher(st), "", emit_desc(st), ""]
+    out.append(f"#endif")
+    print("\n".join(out))
+
+if __name__ == "__main__":
+    main()
@@ -275,14 +275,107 @@ transitions = [
     ('ERR_INVALID_START', [(ALL, 'ERR_INVALID_START')]),
 ]
 
-## print out the transitions as an initializer list
+## build the full [state][byte] matrix with C designated initializer semantics:
+## later entries win and anything unspecified stays at START
 
-init_list = ''
+table = [[state_index["START"]] * INPUT_RANGE for _ in range(state_index["JSON_BV_STATE_SIZE"])]
 for state_from, tran_to in transitions:
-    line = '[' + state_from + '] = { \n'
+    if state_from == "JSON_BV_STATE_SIZE":
+        continue
     for t_list, state_to in tran_to:
-        line = line + ',\n'.join([f"[{t_list[i]}] = {state_to}" for i in range(len(t_list))]) + ',\n'
-    line = line + '},\n'
-    init_list = init_list + line
+        for c in t_list:
+            table[state_index[state_from]][c] = state_index[state_to]
 
-print(init_list)
+## bytes that every state treats alike share an equivalence class, so the
+## table is indexed by [state][byte_class[c]] instead of [state][c]
+
+columns = {}
+byte_class = []
+for c in range(INPUT_RANGE):
+    column = tuple(row[c] for row in table)
+    byte_class.append(columns.setdefault(column, len(columns)))
+class_columns = list(columns)
+
+assert len(states) <= 256 and len(class_columns) <= 256
+
+out = ["// Generated by state_machine_gen.py, do not edit.",
+       f"#define JSON_BV_CLASS_COUNT {len(class_columns)}",
+       "",
+       "static const uint8_t byte_class[256] = {"]
+for i in range(0, INPUT_RANGE, 16):
+    out.append("  " + " ".join(f"{k:2}," for k in byte_class[i:i + 16]))
+out.append("};")
+out.append("")
+out.append("static const uint8_t transition_table[JSON_BV_STATE_SIZE][JSON_BV_CLASS_COUNT] = {")
+for s, row in enumerate(table):
+    targets = [states[column[s]] for column in class_columns]
+    out.append(f"  [{states[s]}] = {{ " + ", ".join(targets) + " },")
+out.append("};")
+
+## merged actions: states that do the same work share one action, so the
+## scalar loop dispatches over a handful of actions instead of every state
+
+actions = [
+    ("BV_SKIP", []),
+    ("BV_APPEND", ["STR_UTF_1BYTE", "STR_UTF_2BYTE_1", "STR_UTF_2BYTE_2",
+                   "STR_UTF_3BYTE_1", "STR_UTF_3BYTE_2", "STR_UTF_3BYTE_3",
+                   "STR_UTF_4BYTE_1", "STR_UTF_4BYTE_2", "STR_UTF_4BYTE_3",
+                   "STR_UTF_4BYTE_4"]),
+    ("BV_ESCAPE", ["STR_CONTROL_QUOTE", "STR_CONTROL_REVSOL", "STR_CONTROL_SOL",
+                   "STR_CONTROL_B", "STR_CONTROL_F", "STR_CONTROL_N",
+                   "STR_CONTROL_R", "STR_CONTROL_T"]),
+    ("BV_HEX", ["STR_UNICODE_HEX1", "STR_UNICODE_HEX2", "STR_UNICODE_HEX3",
+                "STR_UNICODE_MAYBE_HS_HEX1", "STR_UNICODE_HS_HEX2",
+                "STR_UNICODE_HS_HEX3", "STR_UNICODE_HS_HEX4"]),
+    ("BV_HEX_END", ["STR_UNICODE_HEX4"]),
+    ("BV_LSHEX", ["STR_UNICODE_LS_HEX1", "STR_UNICODE_LS_HEX2", "STR_UNICODE_LS_HEX3"]),
+    ("BV_LSHEX_END", ["STR_UNICODE_LS_HEX4"]),
+    ("BV_MINUS", ["NUM_MINUS"]),
+    ("BV_INT", ["NUM_ZERO", "NUM_DIGIT19", "NUM_DIGIT"]),
+    ("BV_DECIMAL", ["NUM_DECIMAL_DIGIT"]),
+    ("BV_EXP_MINUS", ["NUM_EXP_MINUS"]),
+    ("BV_EXP", ["NUM_EXP_DIGIT"]),
+    ("BV_NULL", ["NULL_L2"]),
+    ("BV_TRUE", ["BOOL_TE"]),
+    ("BV_FALSE", ["BOOL_FE"]),
+    ("BV_STRING", ["STR_QUOTE_END"]),
+    ("BV_NUMBER", ["NUM_END"]),
+    ("BV_ERROR", [s for s in states[:-1] if s.startswith("ERR_")]),
+]
+
+state_action = {}
+for action, members in actions:
+    for s in members:
+        state_action[s] = action
+
+ESCAPES = {
+    "STR_CONTROL_QUOTE": "'\"'", "STR_CONTROL_REVSOL": "'\\\\'", "STR_CONTROL_SOL": "'/'",
+    "STR_CONTROL_B": "'\\b'", "STR_CONTROL_F": "'\\f'", "STR_CONTROL_N": "'\\n'",
+    "STR_CONTROL_R": "'\\r'", "STR_CONTROL_T": "'\\t'",
+}
+
+out.append("")
+out.append("enum json_bv_action {")
+for action, _ in actions:
+    out.append(f"  {action},")
+out.append("  BV_ACTION_SIZE")
+out.append("};")
+out.append("")
+out.append("static const uint8_t bv_action[JSON_BV_STATE_SIZE] = {")
+for s in states[:-1]:
+    if s in state_action:
+        out.append(f"  [{s}] = {state_action[s]},")
+out.append("};")
+out.append("")
+out.append("static const unsigned char bv_escape[JSON_BV_STATE_SIZE] = {")
+for s, ch in ESCAPES.items():
+    out.append(f"  [{s}] = {ch},")
+out.append("};")
+out.append("")
+out.append("static const uint8_t bv_error[JSON_BV_STATE_SIZE] = {")
+for s in states[:-1]:
+    if s.startswith("ERR_"):
+        out.append(f"  [{s}] = JSON_{s},")
+out.append("};")
+
+print("\n".join(out))